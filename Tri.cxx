@@ -14,20 +14,102 @@
     • Free(lines2[]) to avoid leaks
 */
 
+#define _XOPEN_SOURCE 700   // pread, strtok_r, strcasecmp under -std=c99
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <stdint.h>
 #include <stdarg.h>
 #include <ctype.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 
-#define MAXL 512
+#define MAXL 4096
 #define LNSZ  80
-#define MAXLB 128
+#define MAXLB 1024
 #define MAXS  16
 
 typedef struct { char name[16]; uint32_t addr; } Label;
-typedef struct { int bm, bi; } BorrowFrame;
+typedef struct { int bm, bi, bist; char join[LNSZ]; long rep, h0, rhi; int at; } BorrowFrame;   // bist: id+1 of a bist_async; rep: repeat(n) count, at: its FENCE, h0/rhi: SI and reach on entry
+typedef struct { const char *name; int bits; } DescField;
+
+// mme() descriptor schema, in argument order; packed at natural alignment
+static const DescField mmeDesc[] = {
+    {"sCap",16}, {"dCap",16}, {"size",32},
+    {"srcStride",16}, {"dstStride",16}, {"flags",16}, {"mask",32}
+};
+#define MME_NF    7
+#define MME_DSZ   20   // packed size incl. pad before mask
+#define MME_ALIGN 4    // DMA engine fetches descriptors as dwords
+#define MME_CHAIN 0x8000  // flags: continue at the previous descriptor's cursors
+
+// Firmware intrinsics: INT <vec> followed by operand bytes
+// lat: cycles until the operation completes (default cost model)
+typedef struct { const char *name; uint8_t vec; int nargs, flags; uint32_t lat; } Intrinsic;
+#define IF_RES      1   // returns status in AL/flags: ends a batch
+#define IF_FENCE    2   // patch/origin control: never batched
+#define IF_ALIGN    4   // operands are a dword-aligned descriptor
+#define IF_INTERNAL 8   // emitted by Tri only, not callable
+#define IF_ASYNC    16  // trap returns at once; hardware finishes in background
+#define IF_MEM      32  // engine reads/writes memory (may alias the tape)
+static const Intrinsic intrTab[] = {
+    {"fold_mode",    0x01, 1, 0,                    300},
+    {"power_gate",   0x02, 2, 0,                    800},
+    {"patch_bank",   0x03, 2, IF_FENCE,             200},
+    {"patch_commit", 0x04, 0, IF_FENCE|IF_RES,     4000},   // raw CRC bytes
+    {"org_set",      0x05, 1, IF_FENCE,              40},
+    {"bist_start",   0x10, 1, IF_ASYNC,          100000},
+    {"bist_status",  0x11, 1, IF_RES,                20},   // AL: 0 running, else result
+    {"smt_weight",   0x20, 2, 0,                     40},
+    {"mme",          0x30, 0, IF_ALIGN|IF_ASYNC|IF_MEM, 200},   // + size/4, see mmeDesc
+    {"perf_sample",  0x40, 3, 0,                     30},
+    {"link_config",  0x50, 3, IF_ASYNC,          20000},
+    {"batch",        0x60, 0, IF_ALIGN|IF_INTERNAL,   0},
+};
+#define NINTR ((int)(sizeof intrTab/sizeof intrTab[0]))
+#define CYC_TRAP 40     // INT + IRET round trip
+
+// Cost model overrides from latency(name,cycles); 0 keeps the default
+static uint32_t latSet[NINTR];
+
+// Unit-usage table from unit_use(name,unit...): which units each intrinsic needs
+static uint8_t unitUse[NINTR][256];
+static int     unitDecl[256];
+
+// auto_gate(cycles): break-even idle time for automatic gating, 0 = off
+static uint32_t gateThresh = 0;
+
+// schedule(list): reorder independent ops by latency; schedule(source) keeps order
+static int schedList = 0;
+static int peepOn = 0;
+static int largeTape = 0;         // large_tape(on): DS:SI and ES:DI step through segments
+static int pm32 = 0;              // target(pm32): flat 32-bit code, heads in ESI/EDI
+static int nbulk = 0;             // BULK lines left for lowerBulk()
+
+// Dispatch mode: dispatch(int|batch|far)
+#define DISP_BATCH 1
+#define DISP_FAR   2
+static int dispMode = 0;
+
+// Firmware handler entry points from handler()/handlers(); near if !far
+typedef struct { int set, far; uint16_t seg, off; } Handler;
+static Handler hnd[256];
+
+// DMA engine profile: dma_profile(burst,align,stride)
+static const DescField dmaDesc[] = { {"burst",32}, {"align",16}, {"stride",16} };
+static uint32_t dmaBurst = 0x10000, dmaAlign = 16, dmaStride = 0xFFFF;
+static const DescField streamDesc[] = { {"src",16}, {"n",8}, {"block",16} };
+
+// const NAME = v and tunable NAME in a..b [step s]: substituted into later lines
+typedef struct { char name[16]; uint32_t v, lo, hi, step; int tun, set, decl; } Sym;
+#define MAXSYM 64
+static Sym sym[MAXSYM];
+static int nsym = 0;
+
+static const char *outBin = "out.bin";
 
 // DSL source lines
 static char src[MAXL][LNSZ];
@@ -38,6 +120,18 @@ static char asm1[MAXL][LNSZ];
 static int  asmSrcLine[MAXL];
 static int  al = 0;
 
+// Op tag per asm1 line: intrinsic index+1 on an op's first line,
+// OP_CONT on its remaining lines, 0 for plain lines
+#define OP_CONT (-1)
+#define OP_RAW  (-2)   // user db()/int()/fill(): opaque to analysis
+#define OP_TAPE (-3)   // load/store/head +=, no borrow held
+#define OP_OWN  (-4)   // the same under let &mut / let &: no DMA touches it
+static int  asmOp[MAXL];
+
+// Previous asm1 contents while a pass rewrites it
+static char asmOld[MAXL][LNSZ];
+static int  oldSrc[MAXL], oldOp[MAXL];
+
 // Final assembler lines + asm1 mapping
 static char *lines2[MAXL];
 static int   lines2AsmIdx[MAXL];
@@ -46,11 +140,28 @@ static int   ln2 = 0;
 // Borrow-scope stack
 static BorrowFrame bstack[MAXS];
 static int         sp = 0;
+// SI as far as pass1 can follow it from tape_start(), or -1
+static long        headAt = -1;
+// Furthest tape byte touched since the innermost repeat() opened, -1 if lost
+static long        reachHi = -1;
+// stream() body: its frame, and the block the head must stay in (winLo -1 outside)
+static int         stmSp = 0, nstm = 0;
+static long        winLo = -1, winHi, stmSrc, stmN;
+// End of the highest stream() buffer pair; no code or data may sit below it from 0x500
+static uint32_t    stmEnd = 0;
+// Destination head: 0 none, 1 ES = DS (may alias the tape), 2 disjoint segment
+static int         dstMode = 0;
+// Linear address dst_start() put ES:DI at; writes only go up from there
+static long        dstBase = -1;
 
 // Unified label table
 static Label lbl2[MAXLB];
 static int   nl2 = 0;
 
+// mme() transfer held back for merging with a chained successor
+static uint32_t mmePend[MME_NF];
+static int      mmePendLn = -1;
+
 // Output file
 static FILE *out;
 
@@ -106,6 +217,330 @@ static unsigned parseImm(const char *s, int aidx) {
     return (unsigned)v;
 }
 
+/* Parse an unsigned C-style literal (0x.., decimal); 0 if malformed */
+static int parseNum(const char *s, uint32_t *v) {
+    char *end;
+    if (!isdigit((unsigned char)*s)) return 0;
+    unsigned long long x = strtoull(s, &end, 0);
+    if (*end || x>0xFFFFFFFFull) return 0;
+    *v = (uint32_t)x;
+    return 1;
+}
+
+/* Append one formatted asm1 line mapped to source line i */
+static void emit(int i, const char *fmt, ...) {
+    if (al>=MAXL) dieSrc(i,"asm1 overflow");
+    va_list ap; va_start(ap, fmt);
+    int n = vsnprintf(asm1[al], LNSZ, fmt, ap);
+    va_end(ap);
+    if (n<0 || n>=LNSZ) dieSrc(i,"asm line overflow");
+    asmOp[al] = 0;
+    asmSrcLine[al++] = i;
+}
+
+/* Append raw bytes as DB lines, 12 per line to stay within LNSZ */
+static void emitBytes(int i, const uint8_t *b, int n) {
+    for (int k=0; k<n; k+=12) {
+        char tmp[LNSZ]; int p = sprintf(tmp,"DB ");
+        for (int j=k; j<n && j<k+12; j++)
+            p += sprintf(tmp+p, j>k ? ",0x%02X" : "0x%02X", b[j]);
+        emit(i, "%s", tmp);
+    }
+}
+
+/* Look up the intrinsic called by a lowercased "name(..." line */
+static int findIntr(const char *lower) {
+    for (int k=0; k<NINTR; k++) {
+        size_t n = strlen(intrTab[k].name);
+        if (!(intrTab[k].flags&IF_INTERNAL) && !strncmp(lower, intrTab[k].name, n)
+            && lower[n]=='(') return k;
+    }
+    return -1;
+}
+
+static int findIntrName(const char *nm) {
+    for (int k=0; k<NINTR; k++)
+        if (!(intrTab[k].flags&IF_INTERNAL) && !strcasecmp(nm, intrTab[k].name)) return k;
+    return -1;
+}
+
+static int intrByVec(uint8_t vec) {
+    for (int k=0; k<NINTR; k++) if (intrTab[k].vec==vec) return k;
+    return -1;
+}
+
+/* Emit intrinsic k with its operand bytes as one tagged op */
+static void emitIntr(int i, int k, const uint8_t *b, int n) {
+    int h = al;
+    if (intrTab[k].flags&IF_ALIGN)
+        emit(i,"ALIGN %d,2", MME_ALIGN);   // operands follow the 2-byte INT
+    emit(i,"INT 0x%02X", intrTab[k].vec);
+    emitBytes(i, b, n);
+    asmOp[h] = k+1;
+    for (int j=h+1; j<al; j++) asmOp[j] = OP_CONT;
+}
+
+/* Parse "id, timeout[, label]" of bist_wait()/bist_async() */
+static void parseWait(int i, char *args, const char *fn, uint8_t *id, uint32_t *tmo, char *on) {
+    char tmp[LNSZ], *save, *a[3]; int n = 0;
+    strcpy(tmp, args);
+    for (char *t = strtok_r(tmp, ",", &save); t; t = strtok_r(NULL, ",", &save)) {
+        if (n==3) dieSrc(i,"%s(id, timeout[, label]) takes at most 3 args", fn);
+        a[n++] = trim(t);
+    }
+    uint32_t v;
+    if (n<2) dieSrc(i,"%s(id, timeout[, label])", fn);
+    if (!parseNum(a[0], &v) || v>0xFF) dieSrc(i,"%s() id must be a byte", fn);
+    *id = (uint8_t)v;
+    if (!parseNum(a[1], tmo) || !*tmo || *tmo>0xFFFF) dieSrc(i,"%s() timeout 1..0xFFFF", fn);
+    *on = 0;
+    if (n==3) {
+        if (!*a[2] || strlen(a[2])>15 || isdigit((unsigned char)*a[2])) dieSrc(i,"%s() bad label '%s'", fn, a[2]);
+        strcpy(on, a[2]);
+    }
+}
+
+/* bist_wait: poll bist_status with exponential backoff (PAUSE spins,
+   doubling up to BIST_CAP) until it reports, or the spin budget runs out
+   and AL stays 0.  CX, DX and BP are saved; BX is left to far dispatch. */
+#define BIST_CAP 0x400
+static int nwait = 0;
+static void emitWait(int i, uint8_t id, uint32_t tmo, const char *on) {
+    int w = nwait++;
+    emit(i, "DB 0x51,0x52,0x55");                           // push cx/dx/bp
+    if (pm32) emit(i, "DB 0xBD,0x%02X,0x%02X,0,0,0xBA,0x01,0,0,0", tmo&0xFF, tmo>>8);
+    else emit(i, "DB 0xBD,0x%02X,0x%02X,0xBA,0x01,0x00", tmo&0xFF, tmo>>8); // mov bp,tmo; mov dx,1
+    emit(i, "__bw%d:", w);
+    emitIntr(i, intrByVec(0x11), &id, 1);
+    emit(i, "DB 0x84,0xC0");                                // test al,al
+    emit(i, "JNZ __bd%d", w);
+    emit(i, "DB 0x29,0xD5");                                // sub bp,dx
+    emit(i, "JBE __bd%d", w);                               // budget spent
+    emit(i, "DB 0x89,0xD1,0xF3,0x90");                      // mov cx,dx; pause
+    emit(i, "LOOP -4");
+    emit(i, "DB 0x80,0xFE,0x%02X", BIST_CAP>>8);            // cmp dh,cap
+    emit(i, "JAE 2");
+    emit(i, "DB 0xD1,0xE2");                                // shl dx,1
+    emit(i, "JMP __bw%d", w);
+    emit(i, "__bd%d:", w);
+    emit(i, "DB 0x5D,0x5A,0x59");                           // pop bp/dx/cx
+    if (*on) {
+        emit(i, "DB 0x84,0xC0");
+        emit(i, "JNZ __bk%d", w);
+        emit(i, "JMP %s", on);
+        emit(i, "__bk%d:", w);
+    }
+}
+
+/* timer_start/timer_stop: CPUID-serialized RDTSC with everything saved.
+   The slot record at timerBase+24*slot in DS matches perf_sample's:
+   start latches the TSC, stop adds the delta to total and bumps count. */
+#define SLOT_SZ 24     // u64 total, u32 count, u32 event, u64 latch
+static uint32_t timerBase = 0xF000;
+static void emitTimer(int i, int slot, int stop) {
+    uint32_t a = timerBase+slot*SLOT_SZ, l = a+16, h = a+20;
+    if (pm32) {
+        // the same without 66h prefixes, through disp32 operands
+        emit(i, "DB 0x9C,0x60,0x31,0xC0,0x0F,0xA2,0x0F,0x31");
+        if (!stop) {
+            emit(i, "DB 0x89,0x05,0x%02X,0x%02X,0,0", l&0xFF, l>>8);
+            emit(i, "DB 0x89,0x15,0x%02X,0x%02X,0,0", h&0xFF, h>>8);
+        } else {
+            emit(i, "DB 0x2B,0x05,0x%02X,0x%02X,0,0", l&0xFF, l>>8);
+            emit(i, "DB 0x1B,0x15,0x%02X,0x%02X,0,0", h&0xFF, h>>8);
+            emit(i, "DB 0x01,0x05,0x%02X,0x%02X,0,0", a&0xFF, a>>8);
+            emit(i, "DB 0x11,0x15,0x%02X,0x%02X,0,0", (a+4)&0xFF, (a+4)>>8);
+            emit(i, "DB 0xFF,0x05,0x%02X,0x%02X,0,0", (a+8)&0xFF, (a+8)>>8);
+        }
+        emit(i, "DB 0x61,0x9D");
+        return;
+    }
+    emit(i, "DB 0x9C,0x66,0x60,0x66,0x31,0xC0,0x0F,0xA2,0x0F,0x31");   // pushf; pushad; cpuid; rdtsc
+    if (!stop) {
+        emit(i, "DB 0x66,0xA3,0x%02X,0x%02X", l&0xFF, l>>8);             // mov [latch],eax
+        emit(i, "DB 0x66,0x89,0x16,0x%02X,0x%02X", h&0xFF, h>>8);        // mov [latch+4],edx
+    } else {
+        emit(i, "DB 0x66,0x2B,0x06,0x%02X,0x%02X", l&0xFF, l>>8);        // sub eax,[latch]
+        emit(i, "DB 0x66,0x1B,0x16,0x%02X,0x%02X", h&0xFF, h>>8);        // sbb edx,[latch+4]
+        emit(i, "DB 0x66,0x01,0x06,0x%02X,0x%02X", a&0xFF, a>>8);        // add [total],eax
+        emit(i, "DB 0x66,0x11,0x16,0x%02X,0x%02X", (a+4)&0xFF, (a+4)>>8); // adc [total+4],edx
+        emit(i, "DB 0x66,0xFF,0x06,0x%02X,0x%02X", (a+8)&0xFF, (a+8)>>8); // inc dword [count]
+    }
+    emit(i, "DB 0x66,0x61,0x9D");                                          // popad; popf
+}
+
+/* patch_commit(auto): label the payload that follows the open
+   patch_bank() and leave a CRC32 field for pass B to fill in */
+static int pbAt = -1, npatch = 0;
+static void commitAuto(int i, int k) {
+    if (pbAt<0) dieSrc(i,"patch_commit(auto) without an open patch_bank()");
+    if (al>=MAXL) dieSrc(i,"asm1 overflow");
+    memmove(asm1+pbAt+1, asm1+pbAt, sizeof asm1[0]*(al-pbAt));
+    memmove(asmSrcLine+pbAt+1, asmSrcLine+pbAt, sizeof(int)*(al-pbAt));
+    memmove(asmOp+pbAt+1, asmOp+pbAt, sizeof(int)*(al-pbAt));
+    al++;
+    sprintf(asm1[pbAt], "__pb%d:", npatch);
+    asmOp[pbAt] = 0; asmSrcLine[pbAt] = asmSrcLine[pbAt-1];
+    emit(i, "__pe%d:", npatch);
+    int h = al;
+    emit(i, "INT 0x%02X", intrTab[k].vec);
+    emit(i, "CRC32 __pb%d,__pe%d", npatch, npatch);
+    asmOp[h] = k+1; asmOp[h+1] = OP_CONT;
+    npatch++; pbAt = -1;
+}
+
+/* Parse a comma list of byte operands */
+static int parseBytes(int i, char *args, const char *fn, uint8_t *b) {
+    char *save, *a = strtok_r(args, ",", &save);
+    int n = 0; uint32_t v;
+    for (; a; a = strtok_r(NULL, ",", &save)) {
+        a = trim(a);
+        if (!parseNum(a, &v)) dieSrc(i,"%s() arg %d malformed: '%s'", fn, n+1, a);
+        if (v>0xFF) dieSrc(i,"%s() arg %d out of byte range: %u", fn, n+1, v);
+        if (n>=LNSZ) dieSrc(i,"%s() too many args", fn);
+        b[n++] = (uint8_t)v;
+    }
+    return n;
+}
+
+/* Declare a handler entry point: "seg:off" (far) or "off" (near) */
+static int setHandler(const char *vec, char *addr) {
+    uint32_t v, seg = 0, off;
+    int k = findIntrName(vec);
+    if (k>=0) v = intrTab[k].vec;
+    else if (!parseNum(vec, &v) || v>0xFF) return 0;
+    char *c = strchr(addr, ':');
+    if (c) { *c = 0; if (!parseNum(trim(addr), &seg) || seg>0xFFFF) return 0; addr = c+1; }
+    if (!parseNum(trim(addr), &off) || off>0xFFFF) return 0;
+    hnd[v].set = 1; hnd[v].far = c!=NULL;
+    hnd[v].seg = (uint16_t)seg; hnd[v].off = (uint16_t)off;
+    return 1;
+}
+
+/* Load handler addresses from a map file: "<vec|name> <seg:off|off>";
+   i<0 when called from the command line */
+static void loadHandlers(int i, const char *fn) {
+    FILE *f = fopen(fn,"r");
+    if (!f && i<0) die("cannot open handler map '%s'", fn);
+    if (!f) dieSrc(i,"cannot open handler map '%s'", fn);
+    char buf[LNSZ]; int ln = 0;
+    while (fgets(buf,LNSZ,f)) {
+        char *t = trim(buf), *save; ln++;
+        if (!*t || *t==';') continue;
+        char *vec = strtok_r(t," \t",&save), *addr = strtok_r(NULL," \t",&save);
+        if ((!addr || !setHandler(vec, addr)) && i<0) die("%s:%d: malformed handler entry", fn, ln);
+        if (!addr || !setHandler(vec, addr))
+            dieSrc(i,"%s:%d: malformed handler entry", fn, ln);
+    }
+    fclose(f);
+}
+
+/* Move asm1 into asmOld so a pass can re-emit it; returns old count */
+static int asmRewind() {
+    memcpy(asmOld, asm1, sizeof(asm1[0])*al);
+    memcpy(oldSrc, asmSrcLine, sizeof(int)*al);
+    memcpy(oldOp, asmOp, sizeof(int)*al);
+    int n = al; al = 0;
+    return n;
+}
+
+/* Re-emit asmOld line j unchanged */
+static void keep(int j) {
+    emit(oldSrc[j], "%s", asmOld[j]);
+    asmOp[al-1] = oldOp[j];
+}
+
+/* End (exclusive) of the op starting at asmOld line j */
+static int opEnd(int j, int n) {
+    for (j++; j<n && oldOp[j]==OP_CONT; j++) ;
+    return j;
+}
+
+/* Collect the operand bytes of the op at asmOld[j..e) */
+static int opBytes(int j, int e, uint8_t *b) {
+    int n = 0;
+    for (; j<e; j++) {
+        if (!strncmp(asmOld[j],"CRC32 ",6)) { memset(b+n, 0, 4); n += 4; continue; }
+        if (strncmp(asmOld[j],"DB ",3)) continue;
+        char tmp[LNSZ]; strcpy(tmp, asmOld[j]+3);
+        char *save, *v = strtok_r(tmp," \t,",&save);
+        for (; v; v = strtok_r(NULL," \t,",&save)) b[n++] = (uint8_t)strtoul(v,NULL,0);
+    }
+    return n;
+}
+
+/* Split "a, b, name=c" against a field schema: arity, order, width */
+static void parseFields(int i, char *args, const char *fn,
+                        const DescField *f, int nf, uint32_t *v) {
+    char *save, *a = strtok_r(args, ",", &save);
+    int n = 0;
+    for (; a; a = strtok_r(NULL, ",", &save), n++) {
+        if (n>=nf) continue;   // counted for the arity error below
+        a = trim(a);
+        char *eq = strchr(a, '=');
+        if (eq) {
+            *eq = 0;
+            if (strcasecmp(trim(a), f[n].name))
+                dieSrc(i,"%s() field %d is '%s', got '%s'", fn, n+1, f[n].name, trim(a));
+            a = trim(eq+1);
+        }
+        if (!parseNum(a, &v[n]))
+            dieSrc(i,"%s() field '%s' malformed: '%s'", fn, f[n].name, a);
+        if (f[n].bits<32 && v[n]>>f[n].bits)
+            dieSrc(i,"%s() field '%s' exceeds %d bits: 0x%X", fn, f[n].name, f[n].bits, v[n]);
+    }
+    if (n!=nf) {
+        char sig[LNSZ]; int p = 0;
+        for (int k=0; k<nf; k++) p += snprintf(sig+p, LNSZ-p, k ? ",%s" : "%s", f[k].name);
+        dieSrc(i,"%s() takes %d fields (%s), got %d", fn, nf, sig, n);
+    }
+}
+
+/* Pack fields little-endian at natural alignment; returns packed size */
+static int packFields(const DescField *f, int nf, const uint32_t *v, uint8_t *b) {
+    int off = 0, maxa = 1;
+    for (int k=0; k<nf; k++) {
+        int w = f[k].bits/8;
+        while (off%w) b[off++] = 0;
+        for (int j=0; j<w; j++) b[off++] = (uint8_t)(v[k]>>(8*j));
+        if (w>maxa) maxa = w;
+    }
+    while (off%maxa) b[off++] = 0;
+    return off;
+}
+
+/* Emit the pending mme() as aligned bursts no larger than the profile allows */
+static void flushMme() {
+    if (mmePendLn<0) return;
+    int i = mmePendLn; mmePendLn = -1;
+    uint32_t v[MME_NF]; memcpy(v, mmePend, sizeof v);
+    // keep every burst start aligned: round the burst down to the alignment
+    uint32_t burst = dmaBurst>=dmaAlign ? dmaBurst - dmaBurst%dmaAlign : dmaBurst;
+    uint32_t left = mmePend[2];
+    for (int k=0; left; k++) {
+        uint8_t d[MME_DSZ];
+        v[2] = left<burst ? left : burst;
+        v[5] = mmePend[5] | (k ? MME_CHAIN : 0);
+        left -= v[2];
+        packFields(mmeDesc, MME_NF, v, d);
+        emitIntr(i, intrByVec(0x30), d, MME_DSZ);
+    }
+}
+
+/* Queue an mme(): merge into the pending transfer when it chains onto it */
+static void queueMme(int i, const uint32_t *v) {
+    const uint32_t *p = mmePend;
+    if (mmePendLn>=0 && (v[5]&MME_CHAIN) && v[0]==p[0] && v[1]==p[1]
+        && v[3]==p[3] && v[4]==p[4] && (v[5]&~MME_CHAIN)==(p[5]&~MME_CHAIN)
+        && v[6]==p[6] && p[2]+v[2]>p[2]) {
+        mmePend[2] += v[2];
+        return;
+    }
+    flushMme();
+    memcpy(mmePend, v, sizeof mmePend);
+    mmePendLn = i;
+}
+
 /* Read DSL source lines */
 static void read_src(const char *fn) {
     FILE *f = fopen(fn,"r");
@@ -121,8 +556,92 @@ static void read_src(const char *fn) {
     fclose(f);
 }
 
-/* Compute size of a single asm1 line */
-static uint32_t line_sz(const char *ln) {
+/* const/tunable symbol lookup */
+static Sym *findSym(const char *nm) {
+    for (int k=0; k<nsym; k++) if (!strcmp(sym[k].name, nm)) return &sym[k];
+    return NULL;
+}
+
+/* --set NAME=v: pin a tunable before the source declares it */
+static void setSym(char *arg) {
+    char *eq = strchr(arg, '=');
+    uint32_t v;
+    if (!eq || eq==arg || eq-arg>15 || !parseNum(eq+1, &v)) die("--set NAME=value");
+    if (nsym==MAXSYM) die("--set: more than %d names", MAXSYM);
+    *eq = 0;
+    Sym *s = &sym[nsym++];
+    memset(s, 0, sizeof *s);
+    strcpy(s->name, arg); s->v = v; s->set = 1;
+}
+
+/* const/tunable declaration lines; 1 if line was one */
+static int parseDecl(int i, const char *line, const char *lower) {
+    char nm[LNSZ];
+    int lo, hi, st = 1, n = 0, tun = !strncmp(lower,"tunable ",8);
+    uint32_t v = 0;
+    if (!tun && strncmp(lower,"const ",6)) return 0;
+    if (tun) {
+        const char *p = line+8;
+        if (sscanf(p," %15[A-Za-z0-9_] in %i..%i%n", nm, &lo, &hi, &n)<3) dieSrc(i,"tunable NAME in lo..hi [step s]");
+        p += n; n = 0;
+        if (*p && (sscanf(p," step %i%n", &st, &n)<1 || p[n])) dieSrc(i,"tunable NAME in lo..hi [step s]");
+        if (lo<0 || hi<lo || st<1) dieSrc(i,"tunable range must be 0 <= lo <= hi, step >= 1");
+        v = (uint32_t)lo;
+    } else {
+        char val[LNSZ];
+        if (sscanf(line+6," %15[A-Za-z0-9_] = %79s%n", nm, val, &n)!=2 || line[6+n] || !parseNum(val, &v))
+            dieSrc(i,"const NAME = value");
+    }
+    if (!isalpha((unsigned char)nm[0]) && nm[0]!='_') dieSrc(i,"'%s' is not a name", nm);
+    Sym *s = findSym(nm);
+    if (s && s->decl) dieSrc(i,"'%s' already declared", nm);
+    if (!s) {
+        if (nsym==MAXSYM) dieSrc(i,"more than %d const/tunable names", MAXSYM);
+        s = &sym[nsym++];
+        memset(s, 0, sizeof *s);
+        strcpy(s->name, nm);
+    }
+    if (s->set && !tun) dieSrc(i,"--set %s: only a tunable can be set", nm);
+    if (s->set && (s->v<(uint32_t)lo || s->v>(uint32_t)hi || (s->v-lo)%st))
+        dieSrc(i,"--set %s=%u is not in %d..%d step %d", nm, s->v, lo, hi, st);
+    if (!s->set) s->v = v;
+    s->decl = 1; s->tun = tun;
+    if (tun) { s->lo = (uint32_t)lo; s->hi = (uint32_t)hi; s->step = (uint32_t)st; }
+    return 1;
+}
+
+/* Replace declared names in line with their values */
+static void substSyms(int i, char *line) {
+    char out[LNSZ*2]; int n = 0;
+    for (const char *p=line; *p; ) {
+        if ((isalpha((unsigned char)*p) || *p=='_') && (p==line || !(isalnum((unsigned char)p[-1]) || p[-1]=='_'))) {
+            const char *e = p; char nm[LNSZ];
+            while (isalnum((unsigned char)*e) || *e=='_') e++;
+            memcpy(nm, p, e-p); nm[e-p] = 0;
+            Sym *s = e-p<16 ? findSym(nm) : NULL;
+            n += s && s->decl ? sprintf(out+n, "%u", s->v) : sprintf(out+n, "%s", nm);
+            p = e;
+        } else out[n++] = *p++;
+        if (n>=LNSZ) dieSrc(i,"line too long after substituting names");
+    }
+    out[n] = 0;
+    strcpy(line, out);
+}
+
+/* Short branches: rel8 to a label, or a literal displacement */
+typedef struct { const char *mn; uint8_t op; } Jcc;
+static const Jcc jccTab[] = {
+    {"JB",0x72}, {"JAE",0x73}, {"JZ",0x74}, {"JNZ",0x75}, {"JBE",0x76}, {"JA",0x77},
+    {"JL",0x7C}, {"JGE",0x7D}, {"JLE",0x7E}, {"JG",0x7F}, {"LOOP",0xE2}, {"JCXZ",0xE3},
+};
+static int jccOp(const char *mn) {
+    for (size_t k=0; k<sizeof jccTab/sizeof jccTab[0]; k++)
+        if (!strcmp(mn, jccTab[k].mn)) return jccTab[k].op;
+    return -1;
+}
+
+/* Compute size of a single asm1 line at address pc */
+static uint32_t line_sz(const char *ln, uint32_t pc) {
     char tmp[LNSZ]; strcpy(tmp, ln);
     char *tok = strtok(tmp," \t,");
     if (!tok) return 0;
@@ -132,11 +651,24 @@ static uint32_t line_sz(const char *ln) {
         int c=0; while(strtok(NULL," \t,")) c++; return c;
     }
     if (!strcmp(tok,"FILL")) {
-        int n = atoi(strtok(NULL," \t,")); return n;
+        return strtoul(strtok(NULL," \t,"),NULL,0);
+    }
+    if (!strcmp(tok,"ALIGN")) {
+        // ALIGN a,k: NOP-pad until the byte k ahead sits on an a boundary
+        uint32_t a = strtoul(strtok(NULL," \t,"),NULL,0);
+        uint32_t k = strtoul(strtok(NULL," \t,"),NULL,0);
+        return a ? (a-(pc+k)%a)%a : 0;
     }
+    if (!strcmp(tok,"DW")) {
+        int c=0; while(strtok(NULL," \t,")) c++; return 2*c;
+    }
+    if (!strcmp(tok,"NCALL")) return pm32 ? 5 : 3;
+    if (!strcmp(tok,"CRC32")) return 4;
+    if (!strcmp(tok,"RET"))   return 1;
     if (!strcmp(tok,"INT"))   return 2;
-    if (!strcmp(tok,"JMP")||!strcmp(tok,"CALL")) return 5;
-    if (!strcmp(tok,"LJMP"))  return 6;
+    if (!strcmp(tok,"JMP")||!strcmp(tok,"CALL")) return pm32 ? 5 : 3;
+    if (jccOp(tok)>=0) return 2;
+    if (!strcmp(tok,"LJMP"))  return pm32 ? 7 : 5;
     return 0;
 }
 
@@ -163,18 +695,207 @@ static uint32_t find_lbl(const char *nm, int aidx) {
     return 0;
 }
 
+/* An id running under an enclosing bist_async may not be touched before its join */
+static void bistBusy(int i, uint8_t id) {
+    for (int f=1; f<=sp; f++)
+        if (bstack[f].bist==id+1) dieSrc(i,"BIST %u is still running: wait for its join", id);
+}
+
+/* Tape ops as a pass token, statement, access width and encoding for
+   real16 ([SI], 66h for 32-bit cells) and pm32 ([ESI], 66h for 16-bit).
+   The first NCELL are the tape cells through AL, AX or EAX. */
+typedef struct { char tok; const char *fn; int w; const char *r16, *p32; } TapeEnc;
+static const TapeEnc tapeEnc[] = {
+    {'L', "load()",      1, "DB 0x8A,0x04",      "DB 0x8A,0x06"},
+    {'S', "store()",     1, "DB 0x88,0x04",      "DB 0x88,0x06"},
+    {'w', "load16()",    2, "DB 0x8B,0x04",      "DB 0x66,0x8B,0x06"},
+    {'W', "store16()",   2, "DB 0x89,0x04",      "DB 0x66,0x89,0x06"},
+    {'w', "load32()",    4, "DB 0x66,0x8B,0x04", "DB 0x8B,0x06"},
+    {'W', "store32()",   4, "DB 0x66,0x89,0x04", "DB 0x89,0x06"},
+    {'D', "dst_store()", 1, "DB 0x26,0x88,0x05", "DB 0x88,0x07"},
+    {'l', NULL,          1, "DB 0xAC",           "DB 0xAC"},
+    {'s', NULL,          1, "DB 0xAA",           "DB 0xAA"},
+    {'m', NULL,          1, "DB 0xA4",           "DB 0xA4"},
+};
+#define NCELL  6
+#define T_DST  6
+#define NTAPE  (int)(sizeof tapeEnc/sizeof tapeEnc[0])
+#define TAPE_OP(k) (pm32 ? tapeEnc[k].p32 : tapeEnc[k].r16)
+
+/* AL op imm8 statements: ModRM digit of the 80h group (op AL,imm8 is
+   digit<<3|4) and the SSE2 op that does it to 16 bytes */
+static const struct { const char *fn; int digit; uint8_t sse; } aluOps[] = {
+    {"add(", 0, 0xFC}, {"or(", 1, 0xEB}, {"and(", 4, 0xDB}, {"sub(", 5, 0xF8}, {"xor(", 6, 0xEF},
+};
+#define NALU (int)(sizeof aluOps/sizeof aluOps[0])
+
+static int aluOpSse(int digit) {
+    for (int k=0; k<NALU; k++) if (aluOps[k].digit==digit) return aluOps[k].sse;
+    return 0;
+}
+
+/* repeat(n) { body } is PUSH CX; MOV CX,n; body; LOOP; POP CX.  An
+   elementwise map, load(); ALU ops; store(); head += 1, under a let &mut
+   has no dependence between passes: each reads and writes only its own
+   cell and the exclusive borrow keeps other writers off the tape.  It is
+   vectorized: AX cells in pairs in real16, 16 cells per MOVDQU in pm32,
+   then the scalar body for the last 1..W cells, so AL, AH, the flags
+   and SI end as the scalar loop leaves them. */
+static char repBody[MAXL][LNSZ];
+static int  repOp[MAXL], repSrc[MAXL], nrep = 0;
+
+static void emitRep(int i, long n, int nb) {
+    int w = nrep++;
+    if (n>1) {
+        emit(i, pm32 ? "DB 0xB9,%ld,%ld,0,0" : "DB 0xB9,%ld,%ld", n&0xFF, n>>8);
+        asmOp[al-1] = OP_RAW;
+        emit(i, "__rp%d:", w);
+    }
+    for (int k=0; k<nb; k++) { emit(repSrc[k], "%s", repBody[k]); asmOp[al-1] = repOp[k]; }
+    if (n>1) emit(i, "LOOP __rp%d", w);
+}
+
+static void closeRepeat(int i) {
+    int at = bstack[sp].at+1, src = asmSrcLine[at-1], nb = 0, nalu = 0, st = 0, ex = 0, W = pm32 ? 16 : 2;
+    long n = bstack[sp].rep, k[8];
+    int dg[8];
+    const char *why = NULL;
+    for (int f=0; f<=sp; f++) ex |= bstack[f].bm;
+    for (int x=at; x<al; x++) {
+        unsigned op; long v;
+        strcpy(repBody[nb], asm1[x]); repOp[nb] = asmOp[x]; repSrc[nb++] = asmSrcLine[x];
+        if (!strcmp(asm1[x],"FENCE") || st<0) continue;
+        int tape = asmOp[x]==OP_TAPE || asmOp[x]==OP_OWN;
+        if (!tape) st = -1;
+        else if (st==0 && !strcmp(asm1[x], TAPE_OP(0))) st = 1;
+        else if (st==1 && !strcmp(asm1[x], TAPE_OP(1))) st = 2;
+        else if (st==1 && sscanf(asm1[x],"DB 0x%x,%ld", &op, &v)==2 && (op&0xC7)==4) {
+            if (nalu==7) { why = "more than 7 ALU ops"; st = -1; continue; }
+            dg[nalu] = op>>3; k[nalu++] = v;
+        }
+        else if (st==2 && !strcmp(asm1[x],"DB 0x83,0xC6,1")) st = 3;
+        else st = -1;
+    }
+    if (why) ;
+    else if (st!=3) why = "body is not load(), ALU ops, store(), head += 1";
+    else if (!ex) why = "no let &mut to keep other writers off the tape";
+    else if (n<=W) why = "too few passes for a vector";
+    al = at;
+    emit(i, "DB 0x51");                                        // push (e)cx
+    if (why) {
+        fprintf(stderr,"note: vectorize: repeat at source line %d not vectorized: %s\n", src+1, why);
+        emitRep(i, n, nb);
+        emit(i, "DB 0x59");
+        return;
+    }
+    long v = (n-1)/W;
+    int w = nrep++, h;
+    emit(i, "DB 0x50");                                        // push (e)ax
+    for (int q=0; pm32 && q<nalu; q++) {
+        uint32_t kk = (uint32_t)k[q]*0x01010101u;             // XMM1+q = k in every byte
+        emit(i, "DB 0xB8,%u,%u,%u,%u", kk&0xFF, kk>>8&0xFF, kk>>16&0xFF, kk>>24);
+        emit(i, "DB 0x66,0x0F,0x6E,0x%02X,0x66,0x0F,0x70,0x%02X,0", 0xC8+8*q, 0xC9+9*q);
+    }
+    emit(i, pm32 ? "DB 0xB9,%ld,%ld,0,0" : "DB 0xB9,%ld,%ld", v&0xFF, v>>8);
+    asmOp[al-1] = OP_RAW;
+    emit(i, "__vt%d:", w);
+    h = al;
+    if (pm32) {
+        emit(i, "DB 0xF3,0x0F,0x6F,0x06");                     // movdqu xmm0,[esi]
+        for (int q=0; q<nalu; q++) emit(i, "DB 0x66,0x0F,0x%02X,0x%02X", aluOpSse(dg[q]), 0xC1+q);
+        emit(i, "DB 0xF3,0x0F,0x7F,0x06");
+        emit(i, "DB 0x83,0xC6,16");
+    } else {
+        emit(i, "%s", TAPE_OP(2));                             // mov ax,[si]
+        for (int q=0; q<nalu; q++) {
+            emit(i, "DB 0x%02X,%ld", dg[q]<<3|4, k[q]);        // op al,k
+            emit(i, "DB 0x80,0x%02X,%ld", 0xC4|dg[q]<<3, k[q]);   // op ah,k
+        }
+        emit(i, "%s", TAPE_OP(3));
+        emit(i, "DB 0x83,0xC6,2");
+    }
+    for (int x=h; x<al; x++) asmOp[x] = OP_OWN;
+    emit(i, "LOOP __vt%d", w);
+    emit(i, "DB 0x58");
+    emitRep(i, n-v*W, nb);
+    emit(i, "DB 0x59");
+    fprintf(stderr,"note: vectorize: repeat at source line %d: %ld x %d cells, %ld left to the scalar body\n",
+            src+1, v, W, n-v*W);
+}
+
+/* Tape bytes [lo,hi) an op touches, lo -1 if SI is not known: feeds
+   repeat() its reach and keeps a stream() body inside its block */
+static void tapeUse(int i, long lo, long hi) {
+    if (lo<0) {
+        reachHi = -1;
+        if (winLo>=0) dieSrc(i,"stream() body: SI is not known here, cannot prove the access stays in its block");
+        return;
+    }
+    if (reachHi>=0 && hi>reachHi) reachHi = hi;
+    if (winLo>=0 && (lo<winLo || hi>winHi))
+        dieSrc(i,"stream() body: bytes 0x%lX..0x%lX fall outside its 0x%lX-byte block", lo-winLo, hi-winLo-1, winHi-winLo);
+}
+
+/* A DI write in a stream() body: both buffers must lie below all of it */
+static void streamDst(int i) {
+    long end = winLo+2*(winHi-winLo);
+    if (winLo>=0 && dstBase<end)
+        dieSrc(i,"stream() body: destination at 0x%lX may reach the buffers 0x500..0x%lX the DMA fills; dst_start() at or above 0x%lX",
+               dstBase, end-1, end);
+}
+
+/* stream(src, n, block) { body }: the body becomes a subroutine that
+   runs once per block with SI at its buffer, DS:0x500 or right after
+   it.  mme() descriptors are immediates, so the schedule is unrolled:
+   fetch block 0, then per block start the fetch of the next into the
+   other buffer and call the body.  The engine takes one job at a time,
+   so that fetch returns only once the block about to be used has
+   landed; a mask-0 mme() (it writes nothing) syncs before the last.
+   The body holds a let &mut on its buffer and pass1 keeps its accesses
+   inside it, so it never meets the DMA write to the other one. */
+static void closeStream(int i) {
+    long blk = winHi-winLo;
+    int w = nstm++;
+    emit(i, "RET");
+    emit(i, "__se%d:", w);
+    for (long b=0; b<=stmN; b++) {
+        uint32_t v[MME_NF] = { (uint32_t)(stmSrc+b*blk/16), (uint32_t)((0x500+(b&1)*blk)>>4), (uint32_t)blk, 0, 0, 0, 0xFF };
+        if (b==stmN) { v[0] = v[1] = 0; v[2] = 1; v[6] = 0; }   // sync: mask 0 copies nothing
+        queueMme(i, v); flushMme();
+        if (!b) continue;
+        long a = 0x500+((b-1)&1)*blk;
+        emit(i, pm32 ? "DB 0xBE,%ld,%ld,0,0" : "DB 0xBE,%ld,%ld", a&0xFF, a>>8);
+        asmOp[al-1] = OP_RAW;
+        emit(i, "CALL __sb%d", w);
+    }
+    fprintf(stderr,"note: stream: %ld blocks of 0x%lX bytes through 0x500 and 0x%lX, each fetched while the one before it runs\n",
+            stmN, blk, 0x500+blk);
+    winLo = -1; stmSp = 0;
+}
+
 /* PASS1: DSL → asm1 with Python-like syntax & borrow checks */
 static void pass1() {
-    sp=0; bstack[0].bm=bstack[0].bi=0;
+    sp=0; bstack[0].bm=bstack[0].bi=bstack[0].bist=0; bstack[0].rep=0; dstMode=0; headAt=-1;
+    reachHi=-1; stmSp=0; winLo=-1; stmEnd=0; dstBase=-1;
 
     for(int i=0;i<sl;i++){
-        char line[LNSZ];
+        char line[LNSZ]; int k;
         strcpy(line, trim(src[i]));
+        long at=headAt;
+        if(*line && *line!=';') headAt=-1;
 
         char lower[LNSZ];
         for(int j=0; line[j] && j<LNSZ; j++)
             lower[j] = tolower((unsigned char)line[j]);
         lower[strlen(line)] = 0;
+        if(parseDecl(i, line, lower)) continue;
+        if(nsym){
+            substSyms(i, line);
+            for(int j=0; line[j] && j<LNSZ; j++)
+                lower[j] = tolower((unsigned char)line[j]);
+            lower[strlen(line)] = 0;
+        }
+        if(strncmp(lower,"mme(",4)) flushMme();
 
         // Pythonic transforms
         if(!strncmp(lower,"org(",4) && line[strlen(line)-1]==')'){
@@ -201,6 +922,9 @@ static void pass1() {
             line[strlen(line)-1]=0;
             sprintf(line,"CALL %s", line+5);
         }
+        else if(!strcmp(lower,"ret()")){
+            strcpy(line,"RET");
+        }
         else if(!strncmp(lower,"ljmp(",5) && line[strlen(line)-1]==')'){
             line[strlen(line)-1]=0;
             char *p = line+5, *c = strchr(p, ',');
@@ -208,301 +932,1504 @@ static void pass1() {
             *c=0;
             sprintf(line,"LJMP %s:%s", p, c+1);
         }
-        // In pass1(), after existing Pythonic transforms
-
-        else if(!strncmp(lower,"fold_mode(",10) && line[strlen(line)-1]==')'){
-            line[strlen(line)-1]=0;               // strip ')'
-            char *arg = line+10;                  // mode
-            // emit: INT 0x01  +  DB <mode>
-            asmSrcLine[al]=i; strcpy(asm1[al++],"INT 0x01");
-            char tmp[LNSZ]; snprintf(tmp,LNSZ,"DB %s", arg);
-            asmSrcLine[al]=i; strcpy(asm1[al++], tmp);
+        // Intrinsics: INT <vec> + operand bytes, see intrTab
+        else if(!strncmp(lower,"mme(",4) && line[strlen(line)-1]==')'){
+            // mme(sCap,dCap,size,srcStride,dstStride,flags,mask), see mmeDesc
+            line[strlen(line)-1]=0;
+            uint32_t v[MME_NF];
+            parseFields(i, line+4, "mme", mmeDesc, MME_NF, v);
+            if(!v[2]) dieSrc(i,"mme() size must be nonzero");
+            for(int k=3;k<=4;k++){
+                if(v[k]==1) v[k]=0;        // unit stride is contiguous: burst-capable
+                if(v[k]>dmaStride) dieSrc(i,"mme() %s %u exceeds engine stride limit %u",
+                                          mmeDesc[k].name, v[k], dmaStride);
+            }
+            queueMme(i, v);
+            continue;
+        }
+        else if(!strncmp(lower,"dma_profile(",12) && line[strlen(line)-1]==')'){
+            line[strlen(line)-1]=0;
+            uint32_t v[3];
+            parseFields(i, line+12, "dma_profile", dmaDesc, 3, v);
+            if(!v[1] || (v[1]&(v[1]-1))) dieSrc(i,"dma_profile() align must be a power of two");
+            if(v[0]<v[1]) dieSrc(i,"dma_profile() burst smaller than align");
+            dmaBurst=v[0]; dmaAlign=v[1]; dmaStride=v[2];
             continue;
         }
-        else if(!strncmp(lower,"power_gate(",11) && line[strlen(line)-1]==')'){
+        else if(!strncmp(lower,"dispatch(",9) && line[strlen(line)-1]==')'){
             line[strlen(line)-1]=0;
-            char *p = line+11, *c = strchr(p, ',');
-            if(!c) dieSrc(i,"power_gate(unit,op)");
-            *c=0; char *unit=p; char *op=trim(c+1);
-            asmSrcLine[al]=i; strcpy(asm1[al++],"INT 0x02");
-            char tmp[LNSZ]; snprintf(tmp,LNSZ,"DB %s,%s", unit, op);
-            asmSrcLine[al]=i; strcpy(asm1[al++], tmp);
+            char *save, *m=strtok_r(line+9,",",&save);
+            for(dispMode=0; m; m=strtok_r(NULL,",",&save)){
+                m=trim(m);
+                if(!strcasecmp(m,"batch")) dispMode|=DISP_BATCH;
+                else if(!strcasecmp(m,"far")) dispMode|=DISP_FAR;
+                else if(strcasecmp(m,"int")) dieSrc(i,"unknown dispatch mode '%s'", m);
+            }
             continue;
         }
-        else if(!strncmp(lower,"bist_start(",11) && line[strlen(line)-1]==')'){
-            line[strlen(line)-1]=0; char *id=line+11;
-            asmSrcLine[al]=i; strcpy(asm1[al++],"INT 0x10");
-            char tmp[LNSZ]; snprintf(tmp,LNSZ,"DB %s", id);
-            asmSrcLine[al]=i; strcpy(asm1[al++], tmp);
+        else if(!strncmp(lower,"handler(",8) && line[strlen(line)-1]==')'){
+            line[strlen(line)-1]=0;
+            char *p=line+8, *c=strchr(p,',');
+            if(!c) dieSrc(i,"handler(vec, seg:off)");
+            *c=0;
+            if(!setHandler(trim(p), trim(c+1))) dieSrc(i,"malformed handler address");
             continue;
         }
-        else if(!strncmp(lower,"smt_weight(",11) && line[strlen(line)-1]==')'){
+        else if(!strncmp(lower,"handlers(",9) && line[strlen(line)-1]==')'){
             line[strlen(line)-1]=0;
-            char *p=line+11,*c=strchr(p,','); if(!c) dieSrc(i,"smt_weight(t,w)");
-            *c=0; char *tid=p; char *w=trim(c+1);
-            asmSrcLine[al]=i; strcpy(asm1[al++],"INT 0x20");
-            char tmp[LNSZ]; snprintf(tmp,LNSZ,"DB %s,%s", tid, w);
-            asmSrcLine[al]=i; strcpy(asm1[al++], tmp);
+            char *fn=trim(line+9);
+            if(*fn=='"' && fn[strlen(fn)-1]=='"'){ fn[strlen(fn)-1]=0; fn++; }
+            loadHandlers(i, fn);
             continue;
         }
-        else if(!strncmp(lower,"mme(",4) && line[strlen(line)-1]==')'){
-            // mme(src_cap,dst_cap,size,stride,flags)
-            line[strlen(line)-1]=0; char *p=line+4;
-            // trust DB formatting here; let user supply bytes or a packed tuple label
-            asmSrcLine[al]=i; strcpy(asm1[al++],"INT 0x30");
-            char tmp[LNSZ]; snprintf(tmp,LNSZ,"DB %s", p);
-            asmSrcLine[al]=i; strcpy(asm1[al++], tmp);
+        else if((!strncmp(lower,"timer_start(",12) || !strncmp(lower,"timer_stop(",11))
+                && line[strlen(line)-1]==')'){
+            line[strlen(line)-1]=0;
+            uint32_t v; char *a=trim(strchr(line,'(')+1);
+            if(!parseNum(a,&v) || timerBase+(v+1)*SLOT_SZ>0x10000) dieSrc(i,"timer slot out of range");
+            emitTimer(i, (int)v, lower[8]=='o');
+            continue;
+        }
+        else if(!strncmp(lower,"timer_base(",11) && line[strlen(line)-1]==')'){
+            line[strlen(line)-1]=0;
+            if(!parseNum(trim(line+11),&timerBase) || timerBase>0xFFFF-SLOT_SZ+1)
+                dieSrc(i,"timer_base(addr) within the 64K data segment");
+            continue;
+        }
+        else if(!strncmp(lower,"schedule(",9) && line[strlen(line)-1]==')'){
+            line[strlen(line)-1]=0;
+            char *m=trim(line+9);
+            if(!strcasecmp(m,"list")) schedList=1;
+            else if(!strcasecmp(m,"source")) schedList=0;
+            else dieSrc(i,"unknown schedule mode '%s'", m);
+            continue;
+        }
+        else if(!strncmp(lower,"peephole(",9) && line[strlen(line)-1]==')'){
+            line[strlen(line)-1]=0;
+            char *m=trim(line+9);
+            if(!strcasecmp(m,"on")) peepOn=1;
+            else if(!strcasecmp(m,"off")) peepOn=0;
+            else dieSrc(i,"peephole(on) or peephole(off)");
+            continue;
+        }
+        else if(!strncmp(lower,"target(",7) && line[strlen(line)-1]==')'){
+            line[strlen(line)-1]=0;
+            char *m=trim(line+7);
+            if(al) dieSrc(i,"target() must come before any code");
+            if(!strcasecmp(m,"real16")) pm32=0;
+            else if(!strcasecmp(m,"pm32")) pm32=1;
+            else dieSrc(i,"target(real16) or target(pm32)");
+            continue;
+        }
+        else if(!strncmp(lower,"large_tape(",11) && line[strlen(line)-1]==')'){
+            line[strlen(line)-1]=0;
+            char *m=trim(line+11);
+            if(!strcasecmp(m,"on")) largeTape=1;
+            else if(!strcasecmp(m,"off")) largeTape=0;
+            else dieSrc(i,"large_tape(on) or large_tape(off)");
+            continue;
+        }
+        else if(!strncmp(lower,"latency(",8) && line[strlen(line)-1]==')'){
+            line[strlen(line)-1]=0;
+            char *p=line+8, *c=strchr(p,','); uint32_t v;
+            if(!c) dieSrc(i,"latency(name, cycles)");
+            *c=0;
+            if((k=findIntrName(trim(p)))<0) dieSrc(i,"unknown intrinsic '%s'", trim(p));
+            if(!parseNum(trim(c+1),&v) || !v) dieSrc(i,"malformed latency");
+            latSet[k]=v;
             continue;
         }
-        else if(!strncmp(lower,"patch_bank(",11) && line[strlen(line)-1]==')'){
+        else if(!strncmp(lower,"unit_use(",9) && line[strlen(line)-1]==')'){
             line[strlen(line)-1]=0;
-            char *p=line+11,*c=strchr(p,','); if(!c) dieSrc(i,"patch_bank(bank,flags)");
-            *c=0; char *bank=p; char *flags=trim(c+1);
-            asmSrcLine[al]=i; strcpy(asm1[al++],"INT 0x03");
-            char tmp[LNSZ]; snprintf(tmp,LNSZ,"DB %s,%s", bank, flags);
-            asmSrcLine[al]=i; strcpy(asm1[al++], tmp);
+            char *p=line+9, *c=strchr(p,',');
+            if(!c) dieSrc(i,"unit_use(name, unit...)");
+            *c=0;
+            if((k=findIntrName(trim(p)))<0) dieSrc(i,"unknown intrinsic '%s'", trim(p));
+            uint8_t u[LNSZ]; int nu=parseBytes(i, c+1, "unit_use", u);
+            for(int j=0;j<nu;j++){ unitUse[k][u[j]]=1; unitDecl[u[j]]=1; }
+            continue;
+        }
+        else if(!strncmp(lower,"auto_gate(",10) && line[strlen(line)-1]==')'){
+            line[strlen(line)-1]=0;
+            if(!parseNum(trim(line+10),&gateThresh)) dieSrc(i,"auto_gate(cycles)");
+            continue;
+        }
+        else if(!strncmp(lower,"bist_wait(",10) && line[strlen(line)-1]==')'){
+            line[strlen(line)-1]=0;
+            uint8_t id; uint32_t tmo; char on[LNSZ];
+            parseWait(i, line+10, "bist_wait", &id, &tmo, on);
+            bistBusy(i, id);
+            emitWait(i, id, tmo, on);
+            continue;
+        }
+        else if(!strncmp(lower,"repeat(",7) && line[strlen(line)-1]=='{'){
+            line[strlen(line)-1]=0;
+            char *a=trim(line+7), *end;
+            if(!*a || a[strlen(a)-1]!=')') dieSrc(i,"repeat(n) {");
+            a[strlen(a)-1]=0;
+            long n=strtol(a,&end,0);
+            if(end==a||*trim(end)||n<1||n>0xFFFF) dieSrc(i,"repeat() count 1..0xFFFF");
+            if(sp+1>=MAXS) dieSrc(i,"scope overflow");
+            sp++; bstack[sp].bm=bstack[sp].bi=bstack[sp].bist=0;
+            bstack[sp].rep=n; bstack[sp].at=al;
+            // the body is checked for its first pass from here, the rest at '}'
+            bstack[sp].h0=at; bstack[sp].rhi=reachHi; reachHi=at; headAt=at;
+            emit(i,"FENCE");
+            continue;
+        }
+        else if(!strncmp(lower,"stream(",7) && line[strlen(line)-1]=='{'){
+            line[strlen(line)-1]=0;
+            char *a=trim(line+7);
+            if(!*a || a[strlen(a)-1]!=')') dieSrc(i,"stream(src, n, block) {");
+            a[strlen(a)-1]=0;
+            uint32_t v[3];
+            parseFields(i, a, "stream", streamDesc, 3, v);
+            if(stmSp) dieSrc(i,"stream() blocks do not nest");
+            if(largeTape) dieSrc(i,"stream() buffers live in the first 64 KB: not with large_tape(on)");
+            if(!v[1]) dieSrc(i,"stream() needs at least one block");
+            if(v[2]<16 || v[2]%16 || 0x500+2*v[2]>0x10000) dieSrc(i,"stream() block is a multiple of 16 up to 0x%X", (0x10000-0x500)/2);
+            if(v[0]+v[1]*(v[2]/16)>0x10000) dieSrc(i,"stream() source runs past capability 0xFFFF");
+            if(sp+1>=MAXS) dieSrc(i,"scope overflow");
+            emit(i,"JMP __se%d", nstm);
+            emit(i,"__sb%d:", nstm);
+            // the body owns its buffer: an implicit let &mut
+            sp++; bstack[sp].bm=1; bstack[sp].bi=bstack[sp].bist=0; bstack[sp].rep=0;
+            stmSp=sp; stmSrc=v[0]; stmN=v[1];
+            winLo=headAt=0x500; winHi=0x500+v[2];
+            if(0x500+2*v[2]>stmEnd) stmEnd=0x500+2*v[2];
+            emit(i,"FENCE");
             continue;
         }
-        else if(!strncmp(lower,"patch_commit(",13) && line[strlen(line)-1]==')'){
-            line[strlen(line)-1]=0; char *crc=line+13;
-            asmSrcLine[al]=i; strcpy(asm1[al++],"INT 0x04");
-            char tmp[LNSZ]; snprintf(tmp,LNSZ,"DB %s", crc);
-            asmSrcLine[al]=i; strcpy(asm1[al++], tmp);
+        else if(!strncmp(lower,"bist_async(",11) && line[strlen(line)-1]=='{'){
+            // bist_async(id, timeout[, label]) { independent work } join
+            line[strlen(line)-1]=0;
+            char *a=trim(line+11);
+            if(!*a || a[strlen(a)-1]!=')') dieSrc(i,"bist_async(id, timeout[, label]) {");
+            a[strlen(a)-1]=0;
+            uint8_t id; uint32_t tmo; char on[LNSZ];
+            parseWait(i, a, "bist_async", &id, &tmo, on);
+            bistBusy(i, id);
+            emitIntr(i, intrByVec(0x10), &id, 1);
+            if(sp+1>=MAXS) dieSrc(i,"scope overflow");
+            sp++; bstack[sp].bm=bstack[sp].bi=0; bstack[sp].rep=0;
+            bstack[sp].bist=id+1; strcpy(bstack[sp].join, a);
+            emit(i,"FENCE");
             continue;
         }
-        else if(!strncmp(lower,"perf_sample(",12) && line[strlen(line)-1]==')'){
-            // perf_sample(op,event,slot)
-            line[strlen(line)-1]=0; char *pl=line+12;
-            asmSrcLine[al]=i; strcpy(asm1[al++],"INT 0x40");
-            char tmp[LNSZ]; snprintf(tmp,LNSZ,"DB %s", pl);
-            asmSrcLine[al]=i; strcpy(asm1[al++], tmp);
+        else if(line[0]=='}' && !strcmp(trim(lower+1),"join")){
+            if(sp==0 || !bstack[sp].bist) dieSrc(i,"'} join' without bist_async");
+            uint8_t id; uint32_t tmo; char on[LNSZ];
+            parseWait(i, bstack[sp].join, "bist_async", &id, &tmo, on);
+            sp--;
+            emit(i,"FENCE");
+            emitWait(i, id, tmo, on);
             continue;
         }
-        else if(!strncmp(lower,"link_config(",12) && line[strlen(line)-1]==')'){
-            line[strlen(line)-1]=0; char *pl=line+12;
-            asmSrcLine[al]=i; strcpy(asm1[al++],"INT 0x50");
-            char tmp[LNSZ]; snprintf(tmp,LNSZ,"DB %s", pl);
-            asmSrcLine[al]=i; strcpy(asm1[al++], tmp);
+        else if((k=findIntr(lower))>=0 && line[strlen(line)-1]==')'){
+            const Intrinsic *in=&intrTab[k];
+            line[strlen(line)-1]=0;
+            if(in->vec==0x04 && !strcasecmp(trim(line+strlen(in->name)+1),"auto")){
+                commitAuto(i, k);
+                continue;
+            }
+            uint8_t b[LNSZ];
+            int n=parseBytes(i, line+strlen(in->name)+1, in->name, b);
+            if(in->nargs && n!=in->nargs)
+                dieSrc(i,"%s() takes %d args, got %d", in->name, in->nargs, n);
+            if((in->vec&0xF0)==0x10) bistBusy(i, b[0]);
+            emitIntr(i, k, b, n);
+            if(in->vec==0x03) pbAt=al;
+            if(in->vec==0x04) pbAt=-1;
             continue;
         }
         // Borrow & scopes
         if(!strcmp(line,"{")) {
             if(sp+1>=MAXS) dieSrc(i,"scope overflow");
-            sp++; bstack[sp].bm=bstack[sp].bi=0;
-            continue;
+            sp++; bstack[sp].bm=bstack[sp].bi=bstack[sp].bist=0; bstack[sp].rep=0;
+            headAt=at; emit(i,"FENCE"); continue;
         }
         if(!strcmp(line,"}")) {
             if(sp==0) dieSrc(i,"unmatched scope close");
-            sp--; continue;
+            if(bstack[sp].bist) dieSrc(i,"bist_async block must end with '} join'");
+            if(bstack[sp].rep) {
+                BorrowFrame *f=&bstack[sp];
+                long n=f->rep, d=at-f->h0, top=reachHi+(n-1)*d;
+                closeRepeat(i);
+                // passes step SI by the same d: the last one reaches furthest
+                if(f->h0>=0 && d>=0 && reachHi>=0) {
+                    int touched=reachHi>f->h0;
+                    reachHi=f->rhi;
+                    if(!pm32 && !largeTape && (top>0x10000 || f->h0+n*d>0xFFFF))
+                        dieSrc(i,"repeat() runs past the end of the tape segment (SI=0x%lX)", f->h0+n*d);
+                    if(touched) tapeUse(i, f->h0, top);
+                    headAt=f->h0+n*d;
+                } else reachHi=-1;
+                sp--; emit(i,"FENCE"); continue;
+            }
+            if(stmSp==sp) { emit(i,"FENCE"); sp--; closeStream(i); continue; }
+            sp--; headAt=at; emit(i,"FENCE"); continue;
         }
         if(!strncmp(line,"let &mut",8)) {
             if(bstack[sp].bm||bstack[sp].bi) dieSrc(i,"borrow error");
-            bstack[sp].bm=1; continue;
+            bstack[sp].bm=1; headAt=at; emit(i,"FENCE"); continue;
         }
         if(!strncmp(line,"let &",5)) {
             if(bstack[sp].bm) dieSrc(i,"borrow error");
-            bstack[sp].bi=1; continue;
+            bstack[sp].bi=1; headAt=at; emit(i,"FENCE"); continue;
         }
+        int own=0;
+        for(int f=0;f<=sp;f++) own|=bstack[f].bm|bstack[f].bi;
 
         // Built‐ins
         if(!strcmp(line,"tape_start()")) {
             if(al+2>=MAXL) dieSrc(i,"asm1 overflow");
             asmSrcLine[al]=i; strcpy(asm1[al++],"ORG 0x500");
-            asmSrcLine[al]=i; strcpy(asm1[al++],"DB 0xBE,0x00,0x05");
+            if(winLo>=0) dieSrc(i,"tape_start() inside a stream() body: SI is set per block");
+            asmSrcLine[al]=i; strcpy(asm1[al++],pm32 ? "DB 0xBE,0x00,0x05,0x00,0x00" : "DB 0xBE,0x00,0x05");
+            headAt=0x500; reachHi=-1;
             continue;
         }
-        if(!strcmp(line,"load()")) {
+        // Only a real16 tape without large_tape(on) ends with its segment
+        int seg64=!pm32 && !largeTape;
+        for(k=0;k<NCELL && strcmp(line,tapeEnc[k].fn);k++);
+        if(k<NCELL) {
+            if(seg64 && at>=0 && at+tapeEnc[k].w>0x10000)
+                dieSrc(i,"%d-byte access at SI=0x%lX runs past the end of the tape segment", tapeEnc[k].w, at);
+            tapeUse(i, at, at+tapeEnc[k].w);
             if(al+1>=MAXL) dieSrc(i,"asm1 overflow");
-            asmSrcLine[al]=i; strcpy(asm1[al++],"DB 0x8A,0x04");
+            asmSrcLine[al]=i; asmOp[al]=own?OP_OWN:OP_TAPE; strcpy(asm1[al++],TAPE_OP(k));
+            headAt=at;
             continue;
         }
-        if(!strcmp(line,"store()")) {
+        // head += N in bytes; head16/head32 += N in cells of that width
+        int w=!strncmp(line,"head +=",7) ? 1 : !strncmp(line,"head16 +=",9) ? 2 : !strncmp(line,"head32 +=",9) ? 4 : 0;
+        if(w) {
+            char *numstr=line+(w==1 ? 7 : 9); char *end;
+            long v=strtol(numstr,&end,0);
+            if(end==numstr||v<0||v*w>255) dieSrc(i,"head offset 0..%d", 255/w);
+            v*=w;
+            if(seg64 && at>=0 && at+v>0xFFFF) dieSrc(i,"head moves past the end of the tape segment (SI=0x%lX)", at+v);
+            if(at>=0) headAt=at+v;
+            char tmp[LNSZ];
+            // ADD SI,imm8 sign-extends: 128..255 need the imm16 form
+            int n=v<128 ? sprintf(tmp,"DB 0x83,0xC6,%ld",v) : sprintf(tmp,"DB 0x81,0xC6,%ld,0%s",v,pm32 ? ",0,0" : "");
+            if(n<0||n>=LNSZ) dieSrc(i,"sprintf overflow");
             if(al+1>=MAXL) dieSrc(i,"asm1 overflow");
-            asmSrcLine[al]=i; strcpy(asm1[al++],"DB 0x88,0x04");
+            asmSrcLine[al]=i; asmOp[al]=own?OP_OWN:OP_TAPE; strcpy(asm1[al++],tmp);
             continue;
         }
-        if(!strncmp(line,"head +=",7)) {
-            char *numstr=line+7; char *end;
+        // Destination head ES:DI; CLD so string ops step forward
+        if(!strcmp(line,"dst_start()")) {
+            dstMode=1; dstBase=0x500; emit(i,pm32 ? "DB 0xBF,0x00,0x05,0x00,0x00,0xFC" : "DB 0x1E,0x07,0xBF,0x00,0x05,0xFC");
+            headAt=at; continue;
+        }
+        if(!strncmp(line,"dst_start(",10) && line[strlen(line)-1]==')') {
+            char *end; long v=strtol(line+10,&end,0);
+            if(end==line+10||*end!=')'||v<0||v>0xFFFF) dieSrc(i,"dst_start segment 0..0xFFFF");
+            dstBase=v<<4;
+            // pm32: MOV EDI,seg<<4; CLD.  The flat tape may reach any segment.
+            if(pm32){
+                long a=v<<4;
+                emit(i,"DB 0xBF,%ld,%ld,%ld,0,0xFC", a&0xFF, a>>8&0xFF, a>>16);
+                dstMode=1; headAt=at;
+                continue;
+            }
+            // PUSH AX; MOV AX,seg; MOV ES,AX; POP AX; MOV DI,0; CLD
+            emit(i,"DB 0x50,0xB8,%ld,%ld,0x8E,0xC0,0x58,0xBF,0x00,0x00,0xFC", v&0xFF, v>>8);
+            // The tape lives in the first 64K: a segment past it cannot alias
+            dstMode=v>=0x1000 && !largeTape ? 2 : 1;
+            headAt=at; continue;
+        }
+        if(!strcmp(line,"dst_store()")) {
+            if(!dstMode) dieSrc(i,"dst_store() before dst_start()");
+            int ex=0;
+            for(int f=0;f<=sp;f++) ex|=bstack[f].bm;
+            if(dstMode==1 && !ex) dieSrc(i,"borrow error: destination may alias the tape, needs let &mut");
+            streamDst(i);
+            if(al+1>=MAXL) dieSrc(i,"asm1 overflow");
+            asmSrcLine[al]=i; asmOp[al]=own?OP_OWN:OP_TAPE; strcpy(asm1[al++],TAPE_OP(T_DST));
+            headAt=at; continue;
+        }
+        if(!strncmp(line,"dst +=",6)) {
+            char *numstr=line+6; char *end;
             long v=strtol(numstr,&end,0);
-            if(end==numstr||v<0||v>255) dieSrc(i,"head offset 0..255");
+            if(end==numstr||v<0||v>255) dieSrc(i,"dst offset 0..255");
+            if(!dstMode) dieSrc(i,"dst += before dst_start()");
             char tmp[LNSZ];
-            int n=sprintf(tmp,"DB 0x83,0xC6,%ld",v);
+            int n=v<128 ? sprintf(tmp,"DB 0x83,0xC7,%ld",v) : sprintf(tmp,"DB 0x81,0xC7,%ld,0%s",v,pm32 ? ",0,0" : "");
             if(n<0||n>=LNSZ) dieSrc(i,"sprintf overflow");
             if(al+1>=MAXL) dieSrc(i,"asm1 overflow");
-            asmSrcLine[al]=i; strcpy(asm1[al++],tmp);
+            asmSrcLine[al]=i; asmOp[al]=own?OP_OWN:OP_TAPE; strcpy(asm1[al++],tmp);
+            headAt=at; continue;
+        }
+        // Bulk ops over n cells from the head: BULK lines until lowerBulk()
+        const char *bulk[]={"tape_clear(","tape_copy(","tape_xor(","tape_add("};
+        for(k=0;k<4 && strncmp(line,bulk[k],strlen(bulk[k]));k++);
+        if(k<4 && line[strlen(line)-1]==')') {
+            char *p=line+strlen(bulk[k]), *end;
+            long n=strtol(p,&end,0), v=0;
+            if(end==p||n<1||n>(pm32 ? 0xFFFFFF : 0xFFFF)) dieSrc(i,"%s) count 1..0x%X", bulk[k], pm32 ? 0xFFFFFF : 0xFFFF);
+            if(k>=2){
+                p=end; if(*p++!=',') dieSrc(i,"%sn, k) takes a byte", bulk[k]);
+                v=strtol(p,&end,0);
+                if(end==p||v<0||v>255) dieSrc(i,"%sn, k) takes a byte", bulk[k]);
+            }
+            if(*trim(end)!=')') dieSrc(i,"malformed %s...)", bulk[k]);
+            if(seg64 && at>=0 && at+n>0xFFFF) dieSrc(i,"%s) runs past the end of the tape segment", bulk[k]);
+            tapeUse(i, at, at+n);
+            if(k==1){
+                if(!dstMode) dieSrc(i,"tape_copy() before dst_start()");
+                int ex=0;
+                for(int f=0;f<=sp;f++) ex|=bstack[f].bm;
+                if(dstMode==1 && !ex) dieSrc(i,"borrow error: destination may alias the tape, needs let &mut");
+                streamDst(i);
+            }
+            if(at>=0) headAt=at+n;
+            static const char *const bop[]={"clear","copy","xor","add"};
+            emit(i,"BULK %s,%ld,%ld", bop[k], n, v);
+            asmOp[al-1]=own?OP_OWN:OP_TAPE; nbulk++;
             continue;
         }
-        else if(!strncmp(lower,"org_set(",8) && line[strlen(line)-1]==')'){
-        line[strlen(line)-1]=0;
-        char *addr = line+8;
-        asmSrcLine[al]=i; strcpy(asm1[al++],"INT 0x05");
-        char tmp[LNSZ]; snprintf(tmp,LNSZ,"DB %s", addr);
-        asmSrcLine[al]=i; strcpy(asm1[al++], tmp);
-        continue;
+
+        // AL op imm8: add/or/and/sub/xor
+        for(k=0;k<NALU && strncmp(line,aluOps[k].fn,strlen(aluOps[k].fn));k++);
+        if(k<NALU && line[strlen(line)-1]==')') {
+            char *p=line+strlen(aluOps[k].fn), *end;
+            long v=strtol(p,&end,0);
+            if(end==p||*trim(end)!=')'||v<0||v>255) dieSrc(i,"%sk) takes a byte", aluOps[k].fn);
+            emit(i,"DB 0x%02X,%ld", aluOps[k].digit<<3|4, v);
+            asmOp[al-1]=own?OP_OWN:OP_TAPE; headAt=at;
+            continue;
         }
-    
+
         // Fallback to copy
         if(al>=MAXL) dieSrc(i,"asm1 overflow");
         asmSrcLine[al]=i;
+        asmOp[al]=(!strncmp(line,"DB ",3)||!strncmp(line,"INT ",4)||!strncmp(line,"FILL ",5))
+                  ? OP_RAW : 0;
         strcpy(asm1[al++], line);
     }
 
+    flushMme();
     if(sp!=0) dieSrc(sl-1,"unclosed scope(s)");
+    if(pm32 && largeTape) die("large_tape(on) is for target(real16): pm32 addresses the tape flat");
+    if(pm32 && dispMode&DISP_FAR) die("dispatch(far) passes 16-bit operand pointers: not for target(pm32)");
+    for(int k=0;k<nsym;k++)
+        if(sym[k].set && !sym[k].decl) die("--set %s: no tunable of that name", sym[k].name);
 }
 
-/* PASS A: copy asm1 → lines2 and record labels */
-static void asm_passA() {
-    for(int i=0;i<al;i++){
-        if(ln2>=MAXL) dieAsm(i,"lines2 overflow");
-        lines2[ln2] = (char*)malloc(LNSZ);
-        if(!lines2[ln2]) dieAsm(i,"out of memory");
-        strcpy(lines2[ln2], asm1[i]);
-        lines2AsmIdx[ln2] = i;
-        ln2++;
-    }
-    uint32_t pc=0;
-    for(int i=0;i<ln2;i++){
-        char tmp[LNSZ]; strcpy(tmp, trim(lines2[i]));
-        char *save, *tok = strtok_r(tmp," \t,",&save);
-        if(!tok) continue;
-        if(tok[strlen(tok)-1]==':'){
-            tok[strlen(tok)-1]=0;
-            recordLabel(tok, pc, i);
-        } else {
-            pc += line_sz(lines2[i]);
+/* Control-flow view of asmOld: blocks split at labels and after branches */
+#define BR_JMP  1
+#define BR_JCC  2
+#define BR_CALL 3
+#define BR_EXIT 4
+typedef struct { int a, e, nsucc, succ[2], callee; } Block;
+static Block blk[MAXL];
+static int   nblk, blkOf[MAXL];
+
+static int isLabel(const char *ln) {
+    size_t n = strcspn(ln," \t,");
+    return n && ln[n-1]==':';
+}
+
+/* Branch kind of an asm line; copies its target into tgt if given */
+static int brKind(const char *ln, char *tgt) {
+    char tmp[LNSZ]; strcpy(tmp, ln);
+    char *save, *op = strtok_r(tmp," \t,",&save), *t;
+    if (!op) return 0;
+    int k = !strcmp(op,"JMP") ? BR_JMP : !strcmp(op,"CALL") ? BR_CALL
+          : !strcmp(op,"LJMP")||!strcmp(op,"RET") ? BR_EXIT : jccOp(op)>=0 ? BR_JCC : 0;
+    if (k && tgt) { t = strtok_r(NULL," \t,",&save); strcpy(tgt, t ? t : ""); }
+    return k;
+}
+
+/* Line index of label nm in asmOld, -1 if absent */
+static int labelAt(const char *nm, int n) {
+    size_t k = strlen(nm);
+    for (int j=0; j<n; j++)
+        if (isLabel(asmOld[j]) && !strncmp(asmOld[j], nm, k) && asmOld[j][k]==':') return j;
+    return -1;
+}
+
+static void buildCfg(int n) {
+    char t[LNSZ];
+    nblk = 0;
+    for (int j=0; j<n; j++) {
+        if (!j || isLabel(asmOld[j]) || brKind(asmOld[j-1], NULL)) {
+            if (nblk) blk[nblk-1].e = j;
+            blk[nblk].a = j; blk[nblk].nsucc = 0; blk[nblk].callee = -1;
+            nblk++;
         }
+        blkOf[j] = nblk-1;
+    }
+    if (nblk) blk[nblk-1].e = n;
+    for (int b=0; b<nblk; b++) {
+        Block *B = &blk[b];
+        int k = brKind(asmOld[B->e-1], t), L = k ? labelAt(t, n) : -1;
+        if ((k==BR_JMP || k==BR_JCC) && L>=0) B->succ[B->nsucc++] = blkOf[L];
+        if (k==BR_CALL && L>=0) B->callee = blkOf[L];
+        if (k!=BR_JMP && k!=BR_EXIT && b+1<nblk) B->succ[B->nsucc++] = b+1;
     }
 }
 
-/* Byte-emit helpers */
-static void e8(uint8_t b){ fputc(b,out); }
-static void e16(uint16_t w){ e8(w&0xFF); e8(w>>8); }
-static void e32(uint32_t w){ e16(w&0xFFFF); e16(w>>16); }
+static int opVec(int j) { return oldOp[j]>0 ? intrTab[oldOp[j]-1].vec : -1; }
 
-/* PASS B: emit out.bin and free lines2 */
-static void asm_passB() {
-    out = fopen("out.bin","wb");
-    if(!out) die("cannot create output file");
+/* Known power/fold state per unit; as a mod-set, nonzero marks "changed" */
+typedef struct { uint8_t pw[256]; int fold; } PState;
+#define PW_UNK 0
+#define PW_OFF 1
+#define PW_ON  2
+static PState pin[MAXL], cmod[MAXL];
+static int    preach[MAXL];
 
-    uint32_t pc=0;
-    for(int i=0;i<ln2;i++){
-        char tmp[LNSZ]; strcpy(tmp, lines2[i]);
-        char *save, *tok = strtok_r(tmp," \t,",&save);
-        if(!tok){ free(lines2[i]); continue; }
+/* power_gate at asmOld[j]: unit and resulting state (op 0 off, 1 on) */
+static int gateOp(int j, int n, int *u, int *st) {
+    uint8_t b[LNSZ];
+    if (opVec(j)!=0x02 || opBytes(j, opEnd(j, n), b)!=2) return 0;
+    *u = b[0]; *st = b[1]==0 ? PW_OFF : b[1]==1 ? PW_ON : PW_UNK;
+    return 1;
+}
 
-        if(!strcmp(tok,"ORG")){
-            unsigned v = parseImm(strtok_r(NULL," \t,",&save), i);
-            pc=v; fseek(out,pc,SEEK_SET);
-            free(lines2[i]); continue;
+static int foldOp(int j, int n) {
+    uint8_t b[LNSZ];
+    return opVec(j)==0x01 && opBytes(j, opEnd(j, n), b)==1 ? b[0] : -1;
+}
+
+/* Mark blocks reachable from b, following calls */
+static int seen[MAXL];
+static void reach(int b) {
+    static int stk[MAXL];
+    int ns = 0;
+    memset(seen, 0, sizeof(int)*nblk);
+    seen[b] = 1; stk[ns++] = b;
+    while (ns) {
+        Block *B = &blk[stk[--ns]];
+        for (int k=-1; k<B->nsucc; k++) {
+            int t = k<0 ? B->callee : B->succ[k];
+            if (t>=0 && !seen[t]) { seen[t] = 1; stk[ns++] = t; }
         }
-        if(!strcmp(tok,"DB")){
-            char *v;
-            while((v=strtok_r(NULL," \t,",&save))){
-                unsigned b=parseImm(v,i);
-                if(b>0xFF) dieAsm(i,"DB byte out of range: %u",b);
-                e8((uint8_t)b); pc++;
-            }
-            free(lines2[i]); continue;
+    }
+}
+
+/* Everything code reachable from block b may transition */
+static void modset(int b, PState *m) {
+    int n = blk[nblk-1].e, u, st;
+    memset(m, 0, sizeof *m);
+    reach(b);
+    for (int x=0; x<nblk; x++) {
+        if (!seen[x]) continue;
+        for (int j=blk[x].a; j<blk[x].e; j++) {
+            if (gateOp(j, n, &u, &st)) m->pw[u] = 1;
+            else if (foldOp(j, n)>=0) m->fold = 1;
+            else if (oldOp[j]==OP_RAW) { memset(m->pw, 1, 256); m->fold = 1; }
         }
-        if(!strcmp(tok,"FILL")){
-            unsigned cnt=parseImm(strtok_r(NULL," \t,",&save), i);
-            unsigned val=parseImm(strtok_r(NULL," \t,",&save), i);
-            if(val>0xFF) dieAsm(i,"FILL byte out of range: %u",val);
-            for(unsigned j=0;j<cnt;j++){ e8((uint8_t)val); pc++; }
-            free(lines2[i]); continue;
+    }
+}
+
+static void pclobber(PState *s, const PState *m) {
+    for (int u=0; u<256; u++) if (m->pw[u]) s->pw[u] = PW_UNK;
+    if (m->fold) s->fold = -1;
+}
+
+/* Apply asmOld line j to the state */
+static void pline(PState *s, int j, int n) {
+    int u, st, f;
+    if (gateOp(j, n, &u, &st)) s->pw[u] = (uint8_t)st;
+    else if ((f = foldOp(j, n))>=0) s->fold = f;
+    else if (oldOp[j]==OP_RAW) { memset(s->pw, PW_UNK, 256); s->fold = -1; }
+    else if (brKind(asmOld[j], NULL)==BR_CALL && blk[blkOf[j]].callee>=0)
+        pclobber(s, &cmod[blk[blkOf[j]].callee]);
+}
+
+static int pmeet(int b, const PState *s) {
+    if (!preach[b]) { pin[b] = *s; preach[b] = 1; return 1; }
+    int ch = 0;
+    for (int u=0; u<256; u++)
+        if (pin[b].pw[u]!=s->pw[u] && pin[b].pw[u]!=PW_UNK) { pin[b].pw[u] = PW_UNK; ch = 1; }
+    if (pin[b].fold!=s->fold && pin[b].fold>=0) { pin[b].fold = -1; ch = 1; }
+    return ch;
+}
+
+/* Forward must-analysis of power/fold state over the CFG.  Calls feed
+   the callee's entry and clobber whatever the callee may transition;
+   blocks without known predecessors start unknown. */
+static void powerFlow(int n) {
+    static int npred[MAXL];
+    memset(npred, 0, sizeof(int)*nblk);
+    for (int b=0; b<nblk; b++) {
+        for (int k=0; k<blk[b].nsucc; k++) npred[blk[b].succ[k]]++;
+        if (blk[b].callee>=0) { npred[blk[b].callee]++; modset(blk[b].callee, &cmod[blk[b].callee]); }
+    }
+    for (int b=0; b<nblk; b++) {
+        preach[b] = !b || !npred[b];
+        memset(&pin[b], 0, sizeof pin[b]); pin[b].fold = -1;
+    }
+    for (int ch=1; ch; ) {
+        ch = 0;
+        for (int b=0; b<nblk; b++) {
+            if (!preach[b]) continue;
+            PState s = pin[b];
+            for (int j=blk[b].a; j<blk[b].e; j++) {
+                if (blk[b].callee>=0 && j==blk[b].e-1) ch |= pmeet(blk[b].callee, &s);
+                pline(&s, j, n);
+            }
+            for (int k=0; k<blk[b].nsucc; k++) ch |= pmeet(blk[b].succ[k], &s);
         }
-        if(!strcmp(tok,"INT")){
-            unsigned imm=parseImm(strtok_r(NULL," \t,",&save), i);
-            if(imm>0xFF) dieAsm(i,"INT imm8 out of range: %u",imm);
-            e8(0xCD); e8((uint8_t)imm); pc+=2;
-            free(lines2[i]); continue;
+    }
+}
+
+/* Move gate pairs and a leading fold_mode out of straight-line loops.
+   A loop is a label plus a later JMP/Jcc back to it, entered only by
+   falling into the label.  When the body turns a unit both on and off,
+   both go: the unit is powered before the label and, if the loop can
+   exit, switched back to its exit state after the back edge.  Keeping a
+   unit on longer never changes what the code computes. */
+typedef struct { int at, after, k, nb, src; uint8_t b[2]; } Ins;
+static Ins ins[2*MAXL];
+static int nins, drop[MAXL];
+
+/* Re-emit asmOld without dropped ops, adding queued intrinsics before
+   (or, with after set, behind) their anchor line */
+static void emitIns(int n) {
+    for (int j=0; j<n; ) {
+        int e = oldOp[j]>0 ? opEnd(j, n) : j+1;
+        for (int x=0; x<nins; x++)
+            if (ins[x].at==j && !ins[x].after) emitIntr(ins[x].src, ins[x].k, ins[x].b, ins[x].nb);
+        if (!drop[j]) for (int x=j; x<e; x++) keep(x);
+        for (int x=0; x<nins; x++)
+            if (ins[x].at==j && ins[x].after) emitIntr(ins[x].src, ins[x].k, ins[x].b, ins[x].nb);
+        j = e;
+    }
+}
+
+static void hoistGates() {
+    int n = asmRewind(), kg = intrByVec(0x02), kf = intrByVec(0x01);
+    char t[LNSZ], t2[LNSZ];
+    buildCfg(n);
+    nins = 0;
+    memset(drop, 0, sizeof(int)*n);
+    for (int j=0; j<n; j++) {
+        int kind = brKind(asmOld[j], t), h = kind ? labelAt(t, n) : -1, ok = 1;
+        if ((kind!=BR_JMP && kind!=BR_JCC) || h<0 || h>j) continue;
+        for (int x=0; x<n && ok; x++)
+            if ((x<h || x>j) && brKind(asmOld[x], t2) && !strcmp(t, t2)) ok = 0;
+        PState m; memset(&m, 0, sizeof m);
+        for (int x=h+1; x<j && ok; x++) {
+            int bk = brKind(asmOld[x], NULL);
+            if (isLabel(asmOld[x]) || oldOp[x]==OP_RAW || (bk && bk!=BR_CALL)) ok = 0;
+            else if (bk==BR_CALL && blk[blkOf[x]].callee>=0) {
+                PState c; modset(blk[blkOf[x]].callee, &c);
+                for (int u=0; u<256; u++) m.pw[u] |= c.pw[u];
+                m.fold |= c.fold;
+            }
         }
-        if(!strcmp(tok,"JMP")||!strcmp(tok,"CALL")){
-            e8(tok[0]=='J'?0xE9:0xE8);
-            uint32_t dest=find_lbl(strtok_r(NULL," \t,",&save), i);
-            int32_t rel=(int32_t)dest-(int32_t)(pc+5);
-            e32((uint32_t)rel); pc+=5;
-            free(lines2[i]); continue;
+        if (!ok) continue;
+        static int on[256], off[256], non[256], noff[256];
+        memset(non, 0, sizeof non); memset(noff, 0, sizeof noff);
+        int u, st, nf = 0;
+        for (int x=h+1; x<j; x++) {
+            if (gateOp(x, n, &u, &st)) {
+                if (st==PW_ON) { on[u] = x; non[u]++; }
+                else if (st==PW_OFF) { off[u] = x; noff[u]++; }
+                else non[u] = noff[u] = 99;
+            }
+            if (foldOp(x, n)>=0) nf++;
         }
-        if(!strcmp(tok,"LJMP")){
-            e8(0xEA);
-            char *p = strtok_r(NULL," \t,",&save);
-            char *sg = strchr(p,':'); *sg++=0;
-            unsigned off=parseImm(p,i), s=parseImm(sg,i);
-            e32(off); e16((uint16_t)s); pc+=6;
-            free(lines2[i]); continue;
+        for (u=0; u<256 && nins+3<=2*MAXL; u++) {
+            if (non[u]!=1 || noff[u]!=1 || m.pw[u] || drop[on[u]] || drop[off[u]]) continue;
+            drop[on[u]] = drop[off[u]] = 1;
+            Ins a = { h, 0, kg, 2, oldSrc[on[u]], {(uint8_t)u, 1} };
+            ins[nins++] = a;
+            if (on[u]<off[u] && kind==BR_JCC) {
+                Ins z = { j, 1, kg, 2, oldSrc[off[u]], {(uint8_t)u, 0} };
+                ins[nins++] = z;
+            }
         }
-        if(tok[strlen(tok)-1]==':'){
-            free(lines2[i]); continue;
+        int f = h+1<j ? foldOp(h+1, n) : -1;
+        if (nf==1 && f>=0 && !m.fold && !drop[h+1]) {
+            drop[h+1] = 1;
+            Ins a = { h, 0, kf, 1, oldSrc[h+1], {(uint8_t)f, 0} };
+            ins[nins++] = a;
         }
-        dieAsm(i,"unknown directive '%s'", tok);
     }
-    fclose(out);
+    emitIns(n);
 }
 
-int main(int argc,char**argv){
-    if(argc!=2){
-        fprintf(stderr,"Usage: %s <source.asm>\n",argv[0]);
-        return 1;
+/* Drop power_gate/fold_mode ops that leave the known state unchanged */
+static void dropRedundant() {
+    int n = asmRewind(), u, st, f;
+    buildCfg(n);
+    powerFlow(n);
+    for (int b=0; b<nblk; b++) {
+        PState s = pin[b];
+        if (!preach[b]) { memset(&s, 0, sizeof s); s.fold = -1; }
+        for (int j=blk[b].a; j<blk[b].e; ) {
+            int e = oldOp[j]>0 ? opEnd(j, n) : j+1;
+            int red = (gateOp(j, n, &u, &st) && st!=PW_UNK && s.pw[u]==st)
+                   || ((f = foldOp(j, n))>=0 && s.fold==f);
+            pline(&s, j, n);
+            if (!red) for (int x=j; x<e; x++) keep(x);
+            j = e;
+        }
+    }
+}
+
+static void optGates() {
+    hoistGates();
+    dropRedundant();
+}
+
+static uint32_t intrLat(int k) { return latSet[k] ? latSet[k] : intrTab[k].lat; }
+
+/* Completion latency of the op at asmOld[j..e) */
+static uint32_t opLat(int j, int e) {
+    int k = oldOp[j]-1;
+    uint32_t c = intrLat(k);
+    if (intrTab[k].vec==0x30) {
+        uint8_t b[LNSZ];
+        if (opBytes(j, e, b)>=8) c += (b[4]|b[5]<<8|b[6]<<16|(uint32_t)b[7]<<24)/4;
+    }
+    return c;
+}
+
+/* Estimated CPU cycles spent on the asm line or op at asmOld[j..e) */
+static uint32_t opCost(int j, int e) {
+    if (oldOp[j]>0)
+        return intrTab[oldOp[j]-1].flags&IF_ASYNC ? CYC_TRAP : CYC_TRAP+opLat(j, e);
+    char tmp[LNSZ]; strcpy(tmp, asmOld[j]);
+    char *save, *tok = strtok_r(tmp," \t,",&save);
+    if (!tok || isLabel(asmOld[j]) || !strcmp(tok,"ORG") || !strcmp(tok,"ALIGN")) return 0;
+    if (!strcmp(tok,"INT")) return CYC_TRAP;
+    uint32_t sz = line_sz(asmOld[j], 0);
+    return sz>1 ? sz/2 : 1;          // ~one instruction per two bytes
+}
+
+/* Does asmOld op j need unit u powered (or hide what it does)? */
+static int usesUnit(int j, int n, int u) {
+    int gu, st;
+    if (oldOp[j]>0) return unitUse[oldOp[j]-1][u] || (gateOp(j, n, &gu, &st) && gu==u);
+    if (oldOp[j]==OP_RAW) return 1;
+    if (brKind(asmOld[j], NULL)==BR_CALL) {
+        int c = blk[blkOf[j]].callee;
+        if (c<0) return 1;
+        reach(c);
+        for (int x=0; x<nblk; x++)
+            if (seen[x])
+                for (int y=blk[x].a; y<blk[x].e; y++)
+                    if (y!=j && brKind(asmOld[y], NULL)!=BR_CALL && usesUnit(y, n, u)) return 1;
     }
-    read_src(argv[1]);
-    pass1();
-    asm_passA();
-    asm_passB();
     return 0;
-}  if(sp+1>=MAXS) dieSrc(i,"scope overflow");
-            sp++; bstack[sp].bm=bstack[sp].bi=0;
+}
+
+/* auto_gate: switch declared units off across single-entry, single-exit
+   regions that never use them and cost more than the break-even
+   threshold, and back on where the region ends.  Costs are lower bounds:
+   a loop body counts once, a loop with no conditional exit forever. */
+static void autoGate() {
+    static uint8_t pwAt[MAXL][256];
+    int n = asmRewind(), kg = intrByVec(0x02);
+    char t[LNSZ];
+    buildCfg(n);
+    powerFlow(n);
+    for (int b=0; b<nblk; b++) {
+        PState s = pin[b];
+        if (!preach[b]) memset(&s, 0, sizeof s);
+        for (int j=blk[b].a; j<blk[b].e; j++) { memcpy(pwAt[j], s.pw, 256); pline(&s, j, n); }
+    }
+    nins = 0;
+    memset(drop, 0, sizeof(int)*n);
+    for (int u=0; u<256; u++) {
+        if (!unitDecl[u]) continue;
+        for (int a=0, busy=0; a<n; ) {
+            // an async op on u keeps the unit busy after the trap returns
+            for (int e; busy>0 && a<n && !usesUnit(a, n, u); a = e) {
+                e = oldOp[a]>0 ? opEnd(a, n) : a+1;
+                busy -= opCost(a, e);
+            }
+            // grow [a,b) over ops that leave u alone and never leave the region
+            int b = a;
+            while (b<n && !usesUnit(b, n, u)) {
+                int k = brKind(asmOld[b], NULL);
+                if (k==BR_EXIT) break;
+                b = oldOp[b]>0 ? opEnd(b, n) : b+1;
+            }
+            for (int ok=0; !ok && b>a; ) {
+                ok = 1;
+                for (int x=0; x<n && ok; x++) {
+                    int k = brKind(asmOld[x], t), L = k ? labelAt(t, n) : -1;
+                    if (L<0) continue;
+                    int xin = x>=a && x<b, lin = L>=a && L<b;
+                    if (xin && !lin && k!=BR_CALL) { b = x; ok = 0; } // exits early
+                    else if (!xin && lin && L>a) { b = L; ok = 0; } // entered mid-way
+                }
+            }
+            uint64_t cyc = 0;
+            for (int x=a; x<b; x = oldOp[x]>0 ? opEnd(x, n) : x+1) {
+                cyc += opCost(x, oldOp[x]>0 ? opEnd(x, n) : x+1);
+                int L = brKind(asmOld[x], t)==BR_JMP ? labelAt(t, n) : -1, y = L;
+                while (y>=a && y<x && brKind(asmOld[y], NULL)!=BR_JCC) y++;
+                if (L>=a && y==x) cyc = UINT64_MAX/2;           // never falls out
+            }
+            if (b>a && pwAt[a][u]==PW_ON && cyc>gateThresh && nins+2<=2*MAXL) {
+                int gu, st, last = b<n && gateOp(b, n, &gu, &st) && gu==u && st==PW_OFF;
+                Ins off = { a, 0, kg, 2, oldSrc[a], {(uint8_t)u, 0} };
+                ins[nins++] = off;
+                if (b<n && !last) {
+                    Ins on = { b, 0, kg, 2, oldSrc[b], {(uint8_t)u, 1} };
+                    ins[nins++] = on;
+                }
+                if (cyc>=UINT64_MAX/2)
+                    fprintf(stderr,"note: auto_gate: unit %d off from source line %d, never needed again\n",
+                            u, oldSrc[a]+1);
+                else
+                    fprintf(stderr,"note: auto_gate: unit %d off at source line %d, on at line %d (>= %llu cycles)\n",
+                            u, oldSrc[a]+1, b<n ? oldSrc[b]+1 : oldSrc[n-1]+1, (unsigned long long)cyc);
+            }
+            if (b>a) { a = b; continue; }
+            int e = oldOp[a]>0 ? opEnd(a, n) : a+1;
+            busy = oldOp[a]>0 && intrTab[oldOp[a]-1].flags&IF_ASYNC ? (int)opLat(a, e) : 0;
+            a = e;
+        }
+    }
+    emitIns(n);
+}
+
+/* --instrument: a start/stop pair around every user-label region, one
+   slot each.  A region runs from its label to the next user label; its
+   stop also goes in front of every JMP, LJMP, RET and HLT inside it and
+   of every Jcc or LOOP to a region label, so loops count one sample per
+   iteration and procedures one per call.  Code after such a Jcc starts
+   a fresh sample.  Calls stay inside (inclusive); out.map lists them for
+   the flat profile. */
+#define INSTR_PMC 1
+#define INSTR_TSC 2
+#define PERF_START 1
+#define PERF_STOP  2
+#define CAL_RUNS   16
+static int instrMode = 0, instrEvt = 0;
+
+static int userLabel(const char *ln) { return isLabel(ln) && strncmp(ln,"__",2); }
+
+static void perfOp(int i, int op, int slot) {
+    uint8_t b[3] = { (uint8_t)op, (uint8_t)instrEvt, (uint8_t)slot };
+    emitIntr(i, intrByVec(0x40), b, 3);
+}
+
+static void probe(int i, int op, int slot) {
+    if (instrMode==INSTR_TSC) emitTimer(i, slot, op==PERF_STOP);
+    else perfOp(i, op, slot);
+}
+
+static int isHlt(int j) {
+    uint8_t b[LNSZ];
+    return oldOp[j]==OP_RAW && opBytes(j, j+1, b)==1 && b[0]==0xF4;
+}
+
+/* Does control never fall through asmOld line j? */
+static int noFall(int j) {
+    int k = brKind(asmOld[j], NULL);
+    return k==BR_JMP || k==BR_EXIT || isHlt(j);
+}
+
+/* Can control leave the region asmOld[a..e) at line j?  RET, LJMP and HLT
+   do; a JMP, Jcc or LOOP does when it goes to a region label (its own
+   included) or outside the region, not on Tri's own loops inside it
+   (__ labels and byte displacements) */
+static int leavesRegion(int j, int n, int a, int e) {
+    char t[LNSZ];
+    int k = brKind(asmOld[j], t), L;
+    if (k==BR_EXIT || isHlt(j)) return 1;
+    if (k!=BR_JMP && k!=BR_JCC) return 0;
+    if (isdigit((unsigned char)*t) || *t=='-' || *t=='+') return 0;   // a byte displacement stays put
+    L = labelAt(t, n);
+    return L<0 || userLabel(asmOld[L]) || L<a || L>=e;
+}
+
+static void instrument(const char *mapfn) {
+    static int slotAt[MAXL];
+    char t[LNSZ];
+    int n = asmRewind(), ns = 0, cur = -1, j0 = 0, open = 0, ra = 0, re = 0;
+    for (int j=0; j<n; j++)
+        if (userLabel(asmOld[j])) {
+            if (ns>=255) dieSrc(oldSrc[j],"--instrument: more than 255 label regions");
+            slotAt[j] = ns++;
+        }
+    FILE *m = fopen(mapfn,"w");
+    if (!m) die("cannot create '%s'", mapfn);
+    fprintf(m,"; Tri slot map: %d slot(s) of %d bytes: u64 total, u32 count, u32 event, u64 latch\n",
+            ns, SLOT_SZ);
+    if (instrMode==INSTR_TSC) {
+        if (timerBase+(ns+1)*SLOT_SZ>0x10000) die("--instrument=tsc: slot table passes 64K");
+        fprintf(m,"mode tsc\nbase 0x%04X\ncalib %d\n", timerBase, ns);
+    }
+    else fprintf(m,"mode pmc 0x%02X\n", instrEvt);
+    while (j0<n && !strncmp(asmOld[j0],"ORG ",4)) j0++;
+    for (int j=0; j<n; j++) {
+        int k = brKind(asmOld[j], t);
+        if (j==j0 && instrMode==INSTR_TSC) {
+            // zero the slot table, then time CAL_RUNS empty regions
+            int i = oldSrc[j], w = (ns+1)*SLOT_SZ/2;
+            emit(i, "DB 0x06,0x57,0x51,0x50,0x1E,0x07,0xFC");      // push es/di/cx/ax; ds->es; cld
+            if (pm32) {
+                emit(i, "DB 0xBF,0x%02X,0x%02X,0,0,0xB9,0x%02X,0x%02X,0,0", timerBase&0xFF, timerBase>>8, w&0xFF, w>>8);
+                emit(i, "DB 0x31,0xC0,0x66,0xF3,0xAB,0xB9,0x%02X,0,0,0", CAL_RUNS);
+            } else {
+                emit(i, "DB 0xBF,0x%02X,0x%02X,0xB9,0x%02X,0x%02X", timerBase&0xFF, timerBase>>8, w&0xFF, w>>8);
+                emit(i, "DB 0x31,0xC0,0xF3,0xAB,0xB9,0x%02X,0x00", CAL_RUNS);   // rep stosw; mov cx,runs
+            }
+            emit(i, "__cal:");
+            emitTimer(i, ns, 0);
+            emitTimer(i, ns, 1);
+            emit(i, "LOOP __cal");
+            emit(i, "DB 0x58,0x59,0x5F,0x07");                     // pop ax/cx/di/es
+        }
+        if (userLabel(asmOld[j])) {
+            if (cur>=0) {
+                if (open && !noFall(j-1)) probe(oldSrc[j-1], PERF_STOP, cur);
+                fprintf(m," %d\n", oldSrc[j-1]+1);
+            }
+            cur = slotAt[j]; open = 1;
+            for (ra = j, re = j+1; re<n && !userLabel(asmOld[re]); re++) ;
+            keep(j);
+            probe(oldSrc[j], PERF_START, cur);
+            fprintf(m,"slot %d %.*s %d", cur, (int)strcspn(asmOld[j],":"), asmOld[j], oldSrc[j]+1);
             continue;
         }
-        if(!strcmp(line,"}")) {
-            if(sp==0) dieSrc(i,"unmatched scope close");
-            sp--; continue;
+        // a Jcc or LOOP out of the region ends the sample; the fall-through,
+        // if it is more than the way into the next region, starts another
+        int out = cur>=0 && leavesRegion(j, n, ra, re);
+        if (out) probe(oldSrc[j], PERF_STOP, cur);
+        keep(j);
+        if (out && k==BR_JCC && (open = j+1<n && !userLabel(asmOld[j+1]))) probe(oldSrc[j], PERF_START, cur);
+    }
+    if (cur>=0) {
+        if (open && !noFall(n-1)) probe(oldSrc[n-1], PERF_STOP, cur);
+        fprintf(m," %d\n", oldSrc[n-1]+1);
+    }
+    // call edges: caller slot -> callee slot
+    cur = -1;
+    for (int j=0; j<n; j++) {
+        if (userLabel(asmOld[j])) cur = slotAt[j];
+        int L = cur>=0 && brKind(asmOld[j], t)==BR_CALL ? labelAt(t, n) : -1;
+        if (L>=0 && userLabel(asmOld[L])) fprintf(m,"call %d %d %d\n", cur, slotAt[L], oldSrc[j]+1);
+    }
+    fclose(m);
+}
+
+/* The list scheduler keeps labels, branches, raw code, FENCE (scope and
+   borrow boundaries) and fence/fold/perf intrinsics in place; only the ops
+   between two of them move. */
+static int schedBarrier(int j) {
+    if (oldOp[j]==OP_TAPE || oldOp[j]==OP_OWN) return 0;
+    if (oldOp[j]<=0) return 1;
+    int v = intrTab[oldOp[j]-1].vec;
+    return intrTab[oldOp[j]-1].flags&IF_FENCE || v==0x01 || v==0x40;
+}
+
+/* Can intrinsic k touch unit u?  Undeclared intrinsics may touch any */
+static int touchesUnit(int k, int u) {
+    if (unitUse[k][u]) return 1;
+    for (int x=0; x<256; x++) if (unitUse[k][x]) return 0;
+    return 1;
+}
+
+/* Must op a stay ahead of the later op b? */
+static int schedDep(int a, int b, int n) {
+    int ta = oldOp[a]<0, tb = oldOp[b]<0, u, st;
+    if (ta && tb) return 1;                          // one SI/AL chain
+    if (ta || tb) {
+        int t = ta ? a : b, f = intrTab[oldOp[ta ? b : a]-1].flags;
+        return f&IF_RES || (f&IF_MEM && oldOp[t]==OP_TAPE);
+    }
+    int ka = oldOp[a]-1, kb = oldOp[b]-1;
+    if ((intrTab[ka].vec&0xF0)==(intrTab[kb].vec&0xF0)) return 1;   // same engine
+    if (gateOp(a, n, &u, &st)) return touchesUnit(kb, u);
+    if (gateOp(b, n, &u, &st)) return touchesUnit(ka, u);
+    for (u=0; u<256; u++) if (unitUse[ka][u] && unitUse[kb][u]) return 1;
+    return 0;
+}
+
+/* List scheduling: within each run between barriers, issue the ready op
+   with the most async latency still ahead of it, so bist_start, mme and
+   link_config go out as early as their dependencies allow and the tape
+   work behind them runs in their shadow.  Ties keep source order.  Also
+   drops the FENCE markers. */
+#define SCHED_MAX 256    // longer runs are scheduled in pieces
+static void schedule() {
+    static char dep[SCHED_MAX][SCHED_MAX];
+    static int item[MAXL], ie[MAXL], npred[MAXL], done[MAXL];
+    static uint32_t prio[MAXL];
+    int n = asmRewind();
+    for (int j=0; j<n; ) {
+        if (!strcmp(asmOld[j],"FENCE")) { j++; continue; }
+        if (!schedList || schedBarrier(j)) { keep(j++); continue; }
+        int m = 0, x = j;
+        while (x<n && m<SCHED_MAX && strcmp(asmOld[x],"FENCE") && !schedBarrier(x)) {
+            item[m] = x;
+            x = ie[m++] = oldOp[x]>0 ? opEnd(x, n) : x+1;
         }
-        if(!strncmp(line,"let &mut",8)) {
-            if(bstack[sp].bm||bstack[sp].bi) dieSrc(i,"borrow error");
-            bstack[sp].bm=1; continue;
+        for (int a=m-1; a>=0; a--) {
+            uint32_t best = 0;
+            npred[a] = done[a] = 0;
+            for (int b=a+1; b<m; b++)
+                if ((dep[a][b] = (char)schedDep(item[a], item[b], n)) && prio[b]>best) best = prio[b];
+            int k = oldOp[item[a]]-1;
+            prio[a] = best + (k>=0 && intrTab[k].flags&IF_ASYNC ? opLat(item[a], ie[a]) : 0);
         }
-        if(!strncmp(line,"let &",5)) {
-            if(bstack[sp].bm) dieSrc(i,"borrow error");
-            bstack[sp].bi=1; continue;
+        for (int a=0; a<m; a++) for (int b=a+1; b<m; b++) npred[b] += dep[a][b];
+        for (int c=0; c<m; c++) {
+            int p = -1, ahead = 0;
+            for (int a=0; a<m; a++)
+                if (!done[a] && !npred[a] && (p<0 || prio[a]>prio[p])) p = a;
+            for (int a=0; a<p; a++) ahead += !done[a];
+            if (ahead && oldOp[item[p]]>0)
+                fprintf(stderr,"note: schedule: %s from source line %d issued ahead of %d op(s)\n",
+                        intrTab[oldOp[item[p]]-1].name, oldSrc[item[p]]+1, ahead);
+            done[p] = 1;
+            for (int b=p+1; b<m; b++) npred[b] -= dep[p][b];
+            for (int y=item[p]; y<ie[p]; y++) keep(y);
         }
+        j = x;
+    }
+}
 
-        // Built‐ins
-        if(!strcmp(line,"tape_start()")) {
-            if(al+2>=MAXL) dieSrc(i,"asm1 overflow");
-            asmSrcLine[al]=i; strcpy(asm1[al++],"ORG 0x500");
-            asmSrcLine[al]=i; strcpy(asm1[al++],"DB 0xBE,0x00,0x05");
-            continue;
+/* peephole(on): each run of adjacent tape ops is rewritten with peepTab,
+   the rule table that ./tri superopt generates.  A rule maps up to
+   PEEP_LEN ops (L load, S store, 1..4 head += n) to cheaper bytes; an
+   exact rule also leaves the flags as they were, a dead one only applies
+   where nothing reads the flags before they are set again. */
+#define PEEP_LEN 6
+typedef struct { char from[PEEP_LEN+1]; uint8_t dead, ni, n, to[12]; } PeepRule;
+
+/* BEGIN peepTab: generated by ./tri superopt, do not edit */
+static const PeepRule peepTab[] = {
+    {"1",      1, 1,  1, {0x46}},
+    {"LL",     0, 1,  2, {0x8A,0x04}},
+    {"LS",     0, 1,  2, {0x8A,0x04}},
+    {"SL",     0, 1,  2, {0x88,0x04}},
+    {"SS",     0, 1,  2, {0x88,0x04}},
+    {"L1L",    0, 2,  5, {0x83,0xC6,0x01,0x8A,0x04}},
+    {"111",    1, 1,  3, {0x83,0xC6,0x03}},
+    {"L11L",   0, 3,  6, {0x46,0x83,0xC6,0x01,0x8A,0x04}},
+    {"L11L",   1, 3,  4, {0x46,0x46,0x8A,0x04}},
+    {"1111",   1, 1,  3, {0x83,0xC6,0x04}},
+    {"L111L",  0, 4,  7, {0x46,0x46,0x83,0xC6,0x01,0x8A,0x04}},
+    {"L111L",  1, 2,  5, {0x83,0xC6,0x03,0x8A,0x04}},
+    {"1L11L",  1, 2,  5, {0x83,0xC6,0x03,0x8A,0x04}},
+    {"1L111",  1, 2,  6, {0x8A,0x44,0x01,0x83,0xC6,0x04}},
+    {"1S111",  1, 2,  6, {0x88,0x44,0x01,0x83,0xC6,0x04}},
+    {"11L11",  1, 2,  6, {0x8A,0x44,0x02,0x83,0xC6,0x04}},
+    {"11S11",  1, 2,  6, {0x88,0x44,0x02,0x83,0xC6,0x04}},
+    {"111L1",  1, 2,  6, {0x8A,0x44,0x03,0x83,0xC6,0x04}},
+    {"111S1",  1, 2,  6, {0x88,0x44,0x03,0x83,0xC6,0x04}},
+    {"11111",  1, 1,  3, {0x83,0xC6,0x05}},
+    {"L11L11", 1, 2,  6, {0x8A,0x44,0x02,0x83,0xC6,0x04}},
+    {"L111L1", 1, 2,  6, {0x8A,0x44,0x03,0x83,0xC6,0x04}},
+    {"L1111L", 0, 3,  8, {0x83,0xC6,0x03,0x83,0xC6,0x01,0x8A,0x04}},
+    {"L1111L", 1, 2,  5, {0x83,0xC6,0x04,0x8A,0x04}},
+    {"1L11L1", 1, 2,  6, {0x8A,0x44,0x03,0x83,0xC6,0x04}},
+    {"1L111L", 0, 3,  8, {0x83,0xC6,0x03,0x83,0xC6,0x01,0x8A,0x04}},
+    {"1L111L", 1, 2,  5, {0x83,0xC6,0x04,0x8A,0x04}},
+    {"1L1111", 1, 2,  6, {0x8A,0x44,0x01,0x83,0xC6,0x05}},
+    {"1S1111", 1, 2,  6, {0x88,0x44,0x01,0x83,0xC6,0x05}},
+    {"11L11L", 0, 3,  8, {0x83,0xC6,0x03,0x83,0xC6,0x01,0x8A,0x04}},
+    {"11L11L", 1, 2,  5, {0x83,0xC6,0x04,0x8A,0x04}},
+    {"11L111", 1, 2,  6, {0x8A,0x44,0x02,0x83,0xC6,0x05}},
+    {"11S111", 1, 2,  6, {0x88,0x44,0x02,0x83,0xC6,0x05}},
+    {"111L11", 1, 2,  6, {0x8A,0x44,0x03,0x83,0xC6,0x05}},
+    {"111S11", 1, 2,  6, {0x88,0x44,0x03,0x83,0xC6,0x05}},
+    {"1111L1", 1, 2,  6, {0x8A,0x44,0x04,0x83,0xC6,0x05}},
+    {"1111S1", 1, 2,  6, {0x88,0x44,0x04,0x83,0xC6,0x05}},
+    {"111111", 1, 1,  3, {0x83,0xC6,0x06}},
+    {"", 0, 0, 0, {0}},
+};
+/* END peepTab */
+#define NPEEP (int)(sizeof peepTab/sizeof peepTab[0] - 1)
+
+/* Tape op at asmOld line j as a token, with its size; 0 if not a tape op.
+   L load, S store, 1..4/h head += n, D dst_store, d/g dst += 1/n,
+   l s m LODSB STOSB MOVSB, w/W load16/32 and store16/32, B bulk op,
+   a AL op imm8, x anything else */
+static int tapeAt(int j) {
+    for (int k=0; k<NTAPE; k++) if (!strcmp(asmOld[j], TAPE_OP(k))) return k;
+    return -1;
+}
+
+static char peepTok(int j, int *sz) {
+    long v;
+    unsigned op;
+    int k;
+    if (oldOp[j]!=OP_TAPE && oldOp[j]!=OP_OWN) return 0;
+    *sz = (int)line_sz(asmOld[j], 0);
+    if ((k = tapeAt(j))>=0) return tapeEnc[k].tok;
+    if (!strncmp(asmOld[j],"BULK ",5)) return 'B';
+    if (sscanf(asmOld[j],"DB 0x%x,%ld", &op, &v)==2 && (op&0xC7)==4 && !strchr(asmOld[j]+8,',')) return 'a';
+    if (sscanf(asmOld[j],"DB 0x83,0xC6,%ld", &v)==1) return v>=1 && v<=4 ? (char)('0'+v) : 'h';
+    if (sscanf(asmOld[j],"DB 0x83,0xC7,%ld", &v)==1) return v==1 ? 'd' : 'g';
+    if (!strncmp(asmOld[j],"DB 0x81,0xC6,",13)) return 'h';
+    if (!strncmp(asmOld[j],"DB 0x81,0xC7,",13)) return 'g';
+    return 'x';
+}
+
+/* Registers a tape token reads (gen) and overwrites (kill) */
+#define LV_FL 1
+#define LV_AL 2
+static void tokLive(char c, int *gen, int *kill) {
+    *gen = *kill = 0;
+    if (c=='L' || c=='l' || c=='w') *kill = LV_AL;
+    else if (c=='S' || c=='D' || c=='s' || c=='W') *gen = LV_AL;
+    else if (c=='x') *gen = LV_FL|LV_AL;
+    else if (c=='B') *kill = LV_FL;
+    else if (c=='a') { *gen = LV_AL; *kill = LV_FL; }
+    else if (c!='m') *kill = LV_FL;
+}
+
+static int tokSetsFl(char c) { int g, k; tokLive(c, &g, &k); return k&LV_FL; }
+
+/* Tape ops spelled by the bytes b[0..n), -1 if there is anything else */
+static int peepSpell(const uint8_t *b, int n, char *t) {
+    int m = 0;
+    for (int i=0; i<n; m++) {
+        if (i+1<n && b[i]==0x8A && b[i+1]==0x04) { t[m] = 'L'; i += 2; }
+        else if (i+1<n && b[i]==0x88 && b[i+1]==0x04) { t[m] = 'S'; i += 2; }
+        else if (i+2<n && b[i]==0x83 && b[i+1]==0xC6 && b[i+2]>=1 && b[i+2]<=4) { t[m] = (char)('0'+b[i+2]); i += 3; }
+        else return -1;
+    }
+    return m;
+}
+
+/* Rewrite tok[0..n) to a fixpoint with the exact rules whose output is
+   tape ops again (LL to L, L1L to 1L), so the table needs no rule for
+   every longer run they compose into.  Each step makes the run cheaper.
+   at[] (if given) follows: a rewritten piece takes its first op's. */
+static int peepNorm(char *tok, int *at, int n, const PeepRule *tab, int ntab) {
+    char t[PEEP_LEN*3];
+    for (int i=0; i<n; ) {
+        int r, len = 0, m = -1;
+        for (r=0; r<ntab; r++) {
+            len = (int)strlen(tab[r].from);
+            if (!tab[r].dead && i+len<=n && !strncmp(tab[r].from, tok+i, len)
+                && (m = peepSpell(tab[r].to, tab[r].n, t))>=0) break;
         }
-        if(!strcmp(line,"load()")) {
-            if(al+1>=MAXL) dieSrc(i,"asm1 overflow");
-            asmSrcLine[al]=i; strcpy(asm1[al++],"DB 0x8A,0x04");
-            continue;
+        if (r==ntab) { i++; continue; }
+        memmove(tok+i+m, tok+i+len, n-i-len);
+        memcpy(tok+i, t, m);
+        if (at) {
+            memmove(at+i+m, at+i+len, (n-i-len)*sizeof *at);
+            for (int k=1; k<m; k++) at[i+k] = at[i];
         }
-        if(!strcmp(line,"store()")) {
-            if(al+1>=MAXL) dieSrc(i,"asm1 overflow");
-            asmSrcLine[al]=i; strcpy(asm1[al++],"DB 0x88,0x04");
-            continue;
+        n += m-len;
+        i = i>PEEP_LEN ? i-PEEP_LEN : 0;              // a match may now start earlier
+    }
+    return n;
+}
+
+/* Cheapest cover of tok[0..n) by kept ops and rules (cost: bytes*16 +
+   instructions).  e[i][0] is the best suffix from i that leaves the
+   flags at i dead, e[i][1] the best suffix overall; no tape op reads
+   the flags, so only the end of the run and the next full set matter. */
+static uint32_t peepPlan(const char *tok, const int *sz, int n, int deadEnd,
+                         const PeepRule *tab, int ntab, int *ch) {
+    static uint32_t e[MAXL+1][2];
+    static int c[MAXL+1][2];
+    const uint32_t INF = 0xFFFFFFFF;
+    e[n][0] = deadEnd ? 0 : INF; e[n][1] = 0;
+    for (int i=n-1; i>=0; i--) {
+        e[i][0] = e[i][1] = INF;
+        for (int r=-1; r<ntab; r++) {
+            int len = r<0 ? 1 : (int)strlen(tab[r].from), h = 0;
+            uint32_t cost = r<0 ? (uint32_t)sz[i]*16+1 : tab[r].n*16u+tab[r].ni;
+            if (i+len>n || (r>=0 && strncmp(tab[r].from, tok+i, len))) continue;
+            for (int k=i; k<i+len; k++) h |= tokSetsFl(tok[k]);
+            for (int k=0; k<2; k++) {
+                int nx = r>=0 && tab[r].dead ? 0 : k ? 1 : !h ? 0 : 1;
+                if (e[i+len][nx]==INF || cost+e[i+len][nx]>=e[i][k]) continue;
+                e[i][k] = cost+e[i+len][nx]; c[i][k] = r;
+            }
         }
-        if(!strncmp(line,"head +=",7)) {
-            char *numstr=line+7; char *end;
-            long v=strtol(numstr,&end,0);
-            if(end==numstr||v<0||v>255) dieSrc(i,"head offset 0..255");
-            char tmp[LNSZ];
-            int n=sprintf(tmp,"DB 0x83,0xC6,%ld",v);
-            if(n<0||n>=LNSZ) dieSrc(i,"sprintf overflow");
-            if(al+1>=MAXL) dieSrc(i,"asm1 overflow");
-            asmSrcLine[al]=i; strcpy(asm1[al++],tmp);
+    }
+    if (ch) for (int i=0, k=1; i<n; ) {
+        int r = c[i][k], len = r<0 ? 1 : (int)strlen(tab[r].from), h = 0;
+        for (int x=i; x<i+len; x++) h |= tokSetsFl(tok[x]);
+        k = r>=0 && tab[r].dead ? 0 : k ? 1 : !h ? 0 : 1;
+        ch[i] = r; i += len;
+    }
+    return e[0][1];
+}
+
+/* Registers asmOld line j reads (gen) and overwrites (kill), as LV_ bits.
+   Intrinsics may read AL and return with the flags they were entered with. */
+static void lineLive(int j, int n, int *gen, int *kill) {
+    char t[LNSZ];
+    int sz, k = brKind(asmOld[j], t), tk = peepTok(j, &sz);
+    *gen = *kill = 0;
+    if (tk) { tokLive(tk, gen, kill); return; }
+    if (oldOp[j]>0) { *gen = LV_AL; return; }
+    if (oldOp[j]==OP_CONT || isLabel(asmOld[j])) return;
+    if (k) {
+        if (k==BR_EXIT || (k!=BR_JMP && labelAt(t, n)<0)) *gen = LV_FL|LV_AL;
+        else if (k==BR_JCC && strncmp(asmOld[j],"LOOP ",5) && strncmp(asmOld[j],"JCXZ ",5)) *gen = LV_FL;
+        return;
+    }
+    if (oldOp[j]==OP_RAW || (strncmp(asmOld[j],"ORG ",4) && strncmp(asmOld[j],"ALIGN ",6)
+        && strncmp(asmOld[j],"DB 0xBE,",8) && strncmp(asmOld[j],"DB 0xBF,",8) && strncmp(asmOld[j],"DB 0x1E,0x07,",13)
+        && strncmp(asmOld[j],"DB 0x50,0xB8,",13))) *gen = LV_FL|LV_AL;
+}
+
+/* Backward liveness of the flags and AL over the CFG; regLive[j]: live after line j */
+static char regLive[MAXL];
+static void liveFlow(int n) {
+    static char in[MAXL];
+    buildCfg(n);
+    memset(in, 0, nblk);
+    for (int ch=1; ch; ) {
+        ch = 0;
+        for (int b=nblk-1; b>=0; b--) {
+            int live = !blk[b].nsucc && blk[b].callee<0 ? LV_FL|LV_AL : 0, g, k;
+            for (int s=0; s<blk[b].nsucc; s++) live |= in[blk[b].succ[s]];
+            if (blk[b].callee>=0) live |= in[blk[b].callee];
+            for (int j=blk[b].e-1; j>=blk[b].a; j--) {
+                lineLive(j, n, &g, &k);
+                regLive[j] = (char)live;
+                live = (live&~k)|g;
+            }
+            if (in[b]!=live) { in[b] = (char)live; ch = 1; }
+        }
+    }
+}
+
+/* Runs of tape ops that use the destination head become string
+   instructions: load(); head += 1 is LODSB, dst_store(); dst += 1 is
+   STOSB, and a load, a dst_store and both steps together are MOVSB when
+   nothing reads AL before the next load.  String instructions leave the
+   flags alone, so the ADDs they replace must set flags nobody reads.
+   DF is clear: dst_start() clears it. */
+static void lowerStreams() {
+    static char tok[MAXL];
+    int n = asmRewind(), sz;
+    liveFlow(n);
+    for (int j=0; j<n; ) {
+        int m = 0, dst = 0, nb = 0, na = 0;
+        for (; j+m<n && (tok[m] = peepTok(j+m, &sz)); m++) dst |= tok[m]=='D' || tok[m]=='d' || tok[m]=='g';
+        if (!dst) { for (int x=0; x<(m ? m : 1); x++) keep(j+x); j += m ? m : 1; continue; }
+        tok[m] = 0;
+        for (int i=0; i<m; ) {
+            const char *t = tok+i;
+            int len = !strncmp(t,"L1Dd",4) || !strncmp(t,"LD1d",4) || !strncmp(t,"LDd1",4) ? 4
+                    : !strncmp(t,"L1",2) || !strncmp(t,"Dd",2) ? 2 : 0, o = 1, h = al;
+            if (!len || regLive[j+i+len-1]&LV_FL) { keep(j+i++); nb++; na++; continue; }
+            for (int x=j+i; x<j+i+len; x++) o &= oldOp[x]==OP_OWN;
+            if (len==4 && !(regLive[j+i+3]&LV_AL)) emit(oldSrc[j+i], "DB 0xA4");
+            else {
+                if (t[0]=='L') emit(oldSrc[j+i], "DB 0xAC");
+                if (len==4 || t[0]=='D') emit(oldSrc[j+i], "DB 0xAA");
+            }
+            for (int x=h; x<al; x++) asmOp[x] = o ? OP_OWN : OP_TAPE;
+            nb += len; na += al-h; i += len;
+        }
+        if (na<nb)
+            fprintf(stderr,"note: streams: tape ops at source lines %d-%d: %d -> %d instructions\n",
+                    oldSrc[j]+1, oldSrc[j+m-1]+1, nb, na);
+        j += m;
+    }
+}
+
+/* large_tape(on): the heads are far pointers that move to the next
+   segment before their offset wraps.  Instead of a carry check after every
+   head move, each stretch of tape ops in a basic block gets one check up
+   front: if SI (DI) plus the furthest byte the stretch reaches would pass
+   0xFFFF, fold SI>>4 into DS and keep SI&15.  A stretch ends with its
+   block, at raw code (which may set SI or DI) and at LT_SPAN bytes of
+   reach, so the check always leaves room. */
+#define LT_SPAN 0x7FF0
+
+/* Byte widths a tape op accesses through SI/DI and how far it moves them */
+static void ltStep(int j, char tk, int *wsi, int *dsi, int *wdi, int *ddi) {
+    const char *p = asmOld[j];
+    long v = !strncmp(p,"DB 0x83,",8) || !strncmp(p,"DB 0x81,",8) ? strtol(p+13, 0, 0) : 0;
+    char op[8];
+    *wsi = *dsi = *wdi = *ddi = 0;
+    switch (tk) {
+    case 'L': case 'S': case 'w': case 'W': *wsi = tapeEnc[tapeAt(j)].w; break;
+    case 'B':
+        sscanf(p, "BULK %7[a-z],%ld", op, &v);
+        *wsi = *dsi = (int)v;
+        if (!strcmp(op,"copy")) *wdi = *ddi = (int)v;
+        break;
+    case 'D': *wdi = 1; break;
+    case 'd': case 'g': *ddi = (int)v; break;
+    case 'l': *wsi = *dsi = 1; break;
+    case 's': *wdi = *ddi = 1; break;
+    case 'm': *wsi = *dsi = *wdi = *ddi = 1; break;
+    case 'a': break;
+    default:  *dsi = (int)v;
+    }
+}
+
+/* [PUSHF] CMP reg,lim; JBE over; PUSH AX/BX; seg += reg>>4; reg &= 15; POP [POPF] */
+static void ltCheck(int i, int di, int reach, int fl) {
+    uint8_t b[32];
+    int n = 0, lim = 0xFFFF-reach;
+    if (fl) b[n++] = 0x9C;
+    b[n++] = 0x81; b[n++] = di ? 0xFF : 0xFE; b[n++] = (uint8_t)lim; b[n++] = (uint8_t)(lim>>8);
+    b[n++] = 0x76; int jbe = n++;
+    b[n++] = 0x50; b[n++] = 0x53;
+    b[n++] = 0x8B; b[n++] = di ? 0xC7 : 0xC6;            // MOV AX,SI|DI
+    b[n++] = 0xC1; b[n++] = 0xE8; b[n++] = 4;            // SHR AX,4
+    b[n++] = 0x8C; b[n++] = di ? 0xC3 : 0xDB;            // MOV BX,ES|DS
+    b[n++] = 0x01; b[n++] = 0xC3;                        // ADD BX,AX
+    b[n++] = 0x8E; b[n++] = di ? 0xC3 : 0xDB;            // MOV ES|DS,BX
+    b[n++] = 0x83; b[n++] = di ? 0xE7 : 0xE6; b[n++] = 0x0F;
+    b[n++] = 0x5B; b[n++] = 0x58;
+    b[jbe] = (uint8_t)(n-jbe-1);
+    if (fl) b[n++] = 0x9D;
+    emitBytes(i, b, n);
+}
+
+/* Stretch of tape ops from line j; returns its end, how far it moves SI/DI
+   and the furthest byte it reaches through each, relative to the start */
+static int ltScan(int j, int n, int *si, int *di, int *rsi, int *rdi) {
+    int e = j, b = blkOf[j], sz;
+    *si = *di = *rsi = *rdi = 0;
+    for (; e<n && blkOf[e]==b; e++) {
+        int wsi, dsi, wdi, ddi;
+        char t = peepTok(e, &sz);
+        if (!t) {
+            if (oldOp[e]>0 || oldOp[e]==OP_CONT) continue;
+            break;
+        }
+        if (t=='x') break;
+        ltStep(e, t, &wsi, &dsi, &wdi, &ddi);
+        int a = dsi>wsi-1 ? *si+dsi : *si+wsi-1, c = ddi>wdi-1 ? *di+ddi : *di+wdi-1;
+        if (a>0xFFF0 || c>0xFFF0) dieSrc(oldSrc[e],"large_tape(on): one op may span at most 0xFFF0 bytes");
+        if (e>j && (a>LT_SPAN || c>LT_SPAN)) break;
+        if (a>*rsi) *rsi = a;
+        if (c>*rdi) *rdi = c;
+        *si += dsi; *di += ddi;
+    }
+    return e;
+}
+
+/* A counted loop MOV CX,T; L: <tape ops>; LOOP L reaches (T-1) steps plus
+   one pass ahead, so its check can go in front of L when that fits */
+static int ltLoop(int j, int n, int *rsi, int *rdi) {
+    char t[LNSZ], *p;
+    long v[3];
+    int k = 0, e = blk[blkOf[j]].e, si, di;
+    if (!j || !isLabel(asmOld[j]) || strncmp(asmOld[j-1],"DB ",3) || oldOp[j-1]!=OP_RAW) return 0;
+    for (p = asmOld[j-1]+2; k<3 && (*p==' ' || *p==','); k++) v[k] = strtol(p+1, &p, 0);
+    if (k<3 || *p || v[0]!=0xB9 || !(v[2]<<8|v[1]) || e-j<3) return 0;
+    if (brKind(asmOld[e-1], t)!=BR_JCC || strncmp(asmOld[e-1],"LOOP ",5) || labelAt(t, n)!=j) return 0;
+    if (ltScan(j+1, n, &si, &di, rsi, rdi)!=e-1) return 0;
+    long T = v[2]<<8|v[1];
+    if ((T-1)*si+*rsi>LT_SPAN || (T-1)*di+*rdi>LT_SPAN) return 0;
+    *rsi += (int)(T-1)*si; *rdi += (int)(T-1)*di;
+    return e;
+}
+
+static void lowerLargeTape() {
+    int n = asmRewind(), sz, nchk = 0, nloop = 0;
+    liveFlow(n);
+    for (int j=0; j<n; ) {
+        char tk = peepTok(j, &sz);
+        int si, di, rsi, rdi, g, k, e = ltLoop(j, n, &rsi, &rdi);
+        if (e) nloop++;
+        else if (!tk || tk=='x') { keep(j++); continue; }
+        else e = ltScan(j, n, &si, &di, &rsi, &rdi);
+        lineLive(j, n, &g, &k);
+        int fl = ((regLive[j]&~k)|g)&LV_FL;
+        if (rsi) { ltCheck(oldSrc[j], 0, rsi, fl); nchk++; }
+        if (rdi) { ltCheck(oldSrc[j], 1, rdi, fl); nchk++; }
+        while (j<e) keep(j++);
+    }
+    if (nchk) fprintf(stderr,"note: large tape: %d segment check(s), %d hoisted out of loops\n", nchk, nloop);
+}
+
+/* peepTab addresses [SI]; under pm32 the same ModRM needs r/m 110, [ESI] */
+static void peepEmit(int i, const uint8_t *b, int n) {
+    uint8_t t[12];
+    memcpy(t, b, n);
+    for (int k=0; pm32 && k<n; ) {
+        if (t[k]==0x8A || t[k]==0x88 || t[k]==0x8D) { t[k+1] |= 2; k += 2+(t[k+1]>>6); }
+        else k += t[k]==0x83 ? 3 : 1;
+    }
+    emitBytes(i, t, n);
+}
+
+static void peephole() {
+    static char tok[MAXL], own[MAXL];
+    static int sz[MAXL], ch[MAXL], at[MAXL];
+    int n = asmRewind();
+    liveFlow(n);
+    for (int j=0; j<n; ) {
+        int m = 0, before = 0;
+        while (j+m<n && (tok[m] = peepTok(j+m, &sz[m]))) { before += sz[m]; at[m] = j+m; m++; }
+        if (!m) { keep(j++); continue; }
+        int dead = !(regLive[j+m-1]&LV_FL), e = j+m;
+        m = peepNorm(tok, at, m, peepTab, NPEEP);
+        for (int i=0; i<m; i++) {
+            if (strchr("LS1234", tok[i])) sz[i] = tok[i]=='L' || tok[i]=='S' ? 2 : 3;
+            else peepTok(at[i], &sz[i]);
+        }
+        uint32_t after = peepPlan(tok, sz, m, dead, peepTab, NPEEP, ch)>>4;
+        for (int x=j; x<e; x++) own[x] = oldOp[x]==OP_OWN;
+        for (int i=0; i<m; ) {
+            int r = ch[i], len = r<0 ? 1 : (int)strlen(peepTab[r].from), h = al, o = 1;
+            for (int x=at[i]; x<(i+len<m ? at[i+len] : e); x++) o &= own[x];
+            if (r>=0) peepEmit(oldSrc[at[i]], peepTab[r].to, peepTab[r].n);
+            else if (!strchr("LS1234", tok[i])) keep(at[i]);
+            else if (tok[i]=='L') emit(oldSrc[at[i]], "%s", TAPE_OP(0));
+            else if (tok[i]=='S') emit(oldSrc[at[i]], "%s", TAPE_OP(1));
+            else emit(oldSrc[at[i]], "DB 0x83,0xC6,%d", tok[i]-'0');
+            for (int x=h; x<al; x++) asmOp[x] = o ? OP_OWN : OP_TAPE;
+            i += len;
+        }
+        if ((int)after<before)
+            fprintf(stderr,"note: peephole: tape ops at source lines %d-%d: %d -> %d bytes\n",
+                    oldSrc[j]+1, oldSrc[e-1]+1, before, (int)after);
+        j = e;
+    }
+}
+
+/* Batch dispatch: a run of adjacent intrinsics becomes one INT 0x60 whose
+   handler walks a table.  Header: count, 3 reserved bytes.  Entry: vec,
+   len, 2 reserved bytes, len operand bytes, zero-padded to a dword so
+   descriptors stay aligned.  The run ends after an IF_RES intrinsic, whose
+   status the batch returns, and at any fence, label or non-intrinsic. */
+static void lowerBatch() {
+    int n = asmRewind();
+    for (int j=0; j<n; ) {
+        int e = j, cnt = 0;
+        while (e<n && oldOp[e]>0 && cnt<255
+               && !(intrTab[oldOp[e]-1].flags&(IF_FENCE|IF_INTERNAL))) {
+            int f = intrTab[oldOp[e]-1].flags;
+            e = opEnd(e, n); cnt++;
+            if (f&IF_RES) break;
+        }
+        if (cnt<2) {
+            for (e = oldOp[j]>0 ? opEnd(j, n) : j+1; j<e; j++) keep(j);
             continue;
         }
+        static uint8_t t[4+255*(4+MME_DSZ)];
+        int tn = 4;
+        t[0] = (uint8_t)cnt; t[1] = t[2] = t[3] = 0;
+        for (int k=j; k<e; k=opEnd(k, n)) {
+            uint8_t *h = t+tn;
+            int len = opBytes(k, opEnd(k, n), t+tn+4);
+            h[0] = intrTab[oldOp[k]-1].vec; h[1] = (uint8_t)len; h[2] = h[3] = 0;
+            tn += 4+len;
+            while (tn%4) t[tn++] = 0;
+        }
+        emitIntr(oldSrc[j], intrByVec(0x60), t, tn);
+        j = e;
+    }
+}
 
-        // Fallback to copy
-        if(al>=MAXL) dieSrc(i,"asm1 overflow");
-        asmSrcLine[al]=i;
-        strcpy(asm1[al++], line);
+/* Far dispatch: intrinsics with a declared handler become a direct call.
+   BX carries the operands: BL/BH when there are at most two bytes, else
+   the address of the operand block, which moves to a pool appended after
+   the code.  Only BX is clobbered; no flags or return IP are pushed/fixed. */
+static void lowerFar() {
+    static int poolJ[MAXL], poolE[MAXL];
+    int np = 0, n = asmRewind();
+    for (int j=0; j<n; ) {
+        const Handler *h = oldOp[j]>0 ? &hnd[intrTab[oldOp[j]-1].vec] : NULL;
+        if (!h || !h->set) { keep(j++); continue; }
+        int e = opEnd(j, n), h0 = al, src = oldSrc[j];
+        uint8_t b[4+255*(4+MME_DSZ)];
+        int len = opBytes(j, e, b);
+        if (len<=2) {
+            emit(src, "DB 0xBB,0x%02X,0x%02X", len>0 ? b[0] : 0, len>1 ? b[1] : 0);
+        } else {
+            if (np>=MAXL) dieSrc(src,"operand pool overflow");
+            poolJ[np] = j; poolE[np] = e;
+            emit(src, "DB 0xBB");
+            emit(src, "DW __op%d", np++);
+        }
+        if (h->far)
+            emit(src, "DB 0x9A,0x%02X,0x%02X,0x%02X,0x%02X",
+                 h->off&0xFF, h->off>>8, h->seg&0xFF, h->seg>>8);
+        else
+            emit(src, "NCALL 0x%X", h->off);
+        asmOp[h0] = oldOp[j];
+        for (int k=h0+1; k<al; k++) asmOp[k] = OP_CONT;
+        j = e;
     }
+    for (int k=0; k<np; k++) {
+        int j = poolJ[k], src = oldSrc[j];
+        if (intrTab[oldOp[j]-1].flags&IF_ALIGN) emit(src, "ALIGN %d,0", MME_ALIGN);
+        emit(src, "__op%d:", k);
+        for (int x=j; x<poolE[k]; x++)    // operand lines move as they are
+            if (!strncmp(asmOld[x],"DB ",3) || !strncmp(asmOld[x],"CRC32 ",6)) emit(src, "%s", asmOld[x]);
+    }
+}
 
-    if(sp!=0) dieSrc(sl-1,"unclosed scope(s)");
+/* Bulk tape ops.  real16 walks the cells with a LOOP (tape_copy: REP
+   MOVSW and a MOVSB for an odd byte); pm32 does 16 cells per pass with
+   MOVDQU and PXOR/PADDB against k in every byte of XMM1, then finishes
+   the n%16 tail a byte at a time.  MOVDQU takes any alignment, so there
+   is no scalar head.  CX/ECX and AX/EAX are kept; flags, XMM0 and XMM1
+   are not. */
+static int bput(uint8_t *b, int m, int n, ...) {
+    va_list ap; va_start(ap, n);
+    while (n--) b[m++] = (uint8_t)va_arg(ap, int);
+    va_end(ap);
+    return m;
+}
+
+static void lowerBulk() {
+    int n = asmRewind();
+    for (int j=0; j<n; j++) {
+        char op[8];
+        long cnt, k;
+        if (strncmp(asmOld[j],"BULK ",5)) { keep(j); continue; }
+        sscanf(asmOld[j], "BULK %7[a-z],%ld,%ld", op, &cnt, &k);
+        int clr = !strcmp(op,"clear"), cpy = !strcmp(op,"copy"), xr = !strcmp(op,"xor");
+        int m = 0, h = al, rm = pm32 ? 0x06 : 0x04;
+        uint8_t b[80];
+        m = bput(b, m, 1, 0x51);                                        // push (e)cx
+        if (!pm32 && cpy) {
+            m = bput(b, m, 5, 0xB9, cnt>>1&0xFF, cnt>>9, 0xF3, 0xA5);      // mov cx,n/2; rep movsw
+            if (cnt&1) m = bput(b, m, 1, 0xA4);
+        } else if (!pm32) {
+            m = bput(b, m, 3, 0xB9, cnt&0xFF, cnt>>8);
+            if (clr) m = bput(b, m, 3, 0xC6, rm, 0);                       // mov byte [si],0
+            else m = bput(b, m, 3, 0x80, rm|(xr ? 0x30 : 0), k);          // xor|add byte [si],k
+            m = bput(b, m, 3, 0x46, 0xE2, 0xFA);                           // inc si; loop
+        } else {
+            long v = cnt>>4, t = cnt&15;
+            if (v) {
+                if (clr) m = bput(b, m, 4, 0x66,0x0F,0xEF,0xC0);           // pxor xmm0,xmm0
+                else if (!cpy) {
+                    uint32_t kk = (uint32_t)k*0x01010101u;
+                    m = bput(b, m, 6, 0x50, 0xB8, kk&0xFF, kk>>8&0xFF, kk>>16&0xFF, kk>>24);
+                    m = bput(b, m, 10, 0x66,0x0F,0x6E,0xC8,                // movd xmm1,eax
+                                       0x66,0x0F,0x70,0xC9,0x00, 0x58);    // pshufd xmm1,xmm1,0; pop eax
+                }
+                m = bput(b, m, 5, 0xB9, v&0xFF, v>>8&0xFF, v>>16&0xFF, 0);
+                int top = m;
+                if (!clr) m = bput(b, m, 4, 0xF3,0x0F,0x6F,0x06);          // movdqu xmm0,[esi]
+                if (xr) m = bput(b, m, 4, 0x66,0x0F,0xEF,0xC1);            // pxor xmm0,xmm1
+                else if (!clr && !cpy) m = bput(b, m, 4, 0x66,0x0F,0xFC,0xC1);   // paddb xmm0,xmm1
+                m = bput(b, m, 4, 0xF3,0x0F,0x7F, cpy ? 0x07 : 0x06);      // movdqu [edi|esi],xmm0
+                m = bput(b, m, 3, 0x83,0xC6,0x10);
+                if (cpy) m = bput(b, m, 3, 0x83,0xC7,0x10);
+                m = bput(b, m, 3, 0x49, 0x75, (top-(m+3))&0xFF);             // dec ecx; jnz
+            }
+            if (t) {
+                m = bput(b, m, 5, 0xB9, t, 0, 0, 0);
+                if (cpy) m = bput(b, m, 2, 0xF3, 0xA4);                    // rep movsb
+                else {
+                    if (clr) m = bput(b, m, 3, 0xC6, rm, 0);
+                    else m = bput(b, m, 3, 0x80, rm|(xr ? 0x30 : 0), k);
+                    m = bput(b, m, 3, 0x46, 0xE2, 0xFA);
+                }
+            }
+        }
+        m = bput(b, m, 1, 0x59);                                        // pop (e)cx
+        emitBytes(oldSrc[j], b, m);
+        for (int x=h; x<al; x++) asmOp[x] = oldOp[j];
+    }
 }
 
 /* PASS A: copy asm1 → lines2 and record labels */
@@ -523,12 +2450,46 @@ static void asm_passA() {
         if(tok[strlen(tok)-1]==':'){
             tok[strlen(tok)-1]=0;
             recordLabel(tok, pc, i);
+        } else if(!strcmp(tok,"ORG")){
+            pc = parseImm(strtok_r(NULL," \t,",&save), i);
         } else {
-            pc += line_sz(lines2[i]);
+            uint32_t n = line_sz(lines2[i], pc);
+            // the DMA would overwrite it: stream() buffers are DS:0x500 up
+            if (n && pc<stmEnd && pc+n>0x500)
+                dieAsm(i,"bytes at 0x%X..0x%X overlap the stream() buffers at 0x500..0x%X", pc, pc+n-1, stmEnd-1);
+            pc += n;
+        }
+    }
+}
+
+/* CRC-32 (IEEE 802.3, reflected): slicing-by-8, bytewise for the tail */
+static uint32_t crcTab[8][256];
+static uint32_t crc32(const uint8_t *p, size_t n) {
+    if (!crcTab[0][1]) {
+        for (uint32_t i=0; i<256; i++) {
+            uint32_t c = i;
+            for (int k=0; k<8; k++) c = c&1 ? 0xEDB88320^(c>>1) : c>>1;
+            crcTab[0][i] = c;
         }
+        for (int i=0; i<256; i++)
+            for (int t=1; t<8; t++) crcTab[t][i] = crcTab[t-1][i]>>8 ^ crcTab[0][crcTab[t-1][i]&0xFF];
+    }
+    uint32_t c = 0xFFFFFFFF;
+    for (; n>=8; p+=8, n-=8) {
+        uint32_t a = c ^ (p[0]|p[1]<<8|p[2]<<16|(uint32_t)p[3]<<24);
+        uint32_t b = p[4]|p[5]<<8|p[6]<<16|(uint32_t)p[7]<<24;
+        c = crcTab[7][a&0xFF] ^ crcTab[6][a>>8&0xFF] ^ crcTab[5][a>>16&0xFF] ^ crcTab[4][a>>24]
+          ^ crcTab[3][b&0xFF] ^ crcTab[2][b>>8&0xFF] ^ crcTab[1][b>>16&0xFF] ^ crcTab[0][b>>24];
     }
+    while (n--) c = crcTab[0][(c^*p++)&0xFF] ^ c>>8;
+    return ~c;
 }
 
+// CRC32 fields to fill once the image is complete
+typedef struct { uint32_t at, a, e; } CrcFix;
+static CrcFix crcFix[MAXL];
+static int    ncrc = 0;
+
 /* Byte-emit helpers */
 static void e8(uint8_t b){ fputc(b,out); }
 static void e16(uint16_t w){ e8(w&0xFF); e8(w>>8); }
@@ -536,7 +2497,7 @@ static void e32(uint32_t w){ e16(w&0xFFFF); e16(w>>16); }
 
 /* PASS B: emit out.bin and free lines2 */
 static void asm_passB() {
-    out = fopen("out.bin","wb");
+    out = fopen(outBin,"wb+");
     if(!out) die("cannot create output file");
 
     uint32_t pc=0;
@@ -559,6 +2520,35 @@ static void asm_passB() {
             }
             free(lines2[i]); continue;
         }
+        if(!strcmp(tok,"DW")){
+            char *v;
+            while((v=strtok_r(NULL," \t,",&save))){
+                uint32_t w = isdigit((unsigned char)*v) ? parseImm(v,i) : find_lbl(v,i);
+                if(w>0xFFFF) dieAsm(i,"DW word out of range: %u",w);
+                e16((uint16_t)w); pc+=2;
+            }
+            free(lines2[i]); continue;
+        }
+        if(!strcmp(tok,"RET")){
+            e8(0xC3); pc++;
+            free(lines2[i]); continue;
+        }
+        if(!strcmp(tok,"CRC32")){
+            // CRC32 start,end: filled in after the last byte is written
+            CrcFix *f=&crcFix[ncrc++];
+            f->a=find_lbl(strtok_r(NULL," \t,",&save), i);
+            f->e=find_lbl(strtok_r(NULL," \t,",&save), i);
+            if(f->e<f->a) dieAsm(i,"patch payload runs backwards (ORG inside the patch?)");
+            f->at=pc; e32(0); pc+=4;
+            free(lines2[i]); continue;
+        }
+        if(!strcmp(tok,"NCALL")){
+            // near CALL rel16 to an absolute offset in this segment
+            unsigned dest=parseImm(strtok_r(NULL," \t,",&save), i);
+            if(pm32){ e8(0xE8); e32(dest-(pc+5)); pc+=5; free(lines2[i]); continue; }
+            e8(0xE8); e16((uint16_t)(dest-(pc+3))); pc+=3;
+            free(lines2[i]); continue;
+        }
         if(!strcmp(tok,"FILL")){
             unsigned cnt=parseImm(strtok_r(NULL," \t,",&save), i);
             unsigned val=parseImm(strtok_r(NULL," \t,",&save), i);
@@ -566,6 +2556,11 @@ static void asm_passB() {
             for(unsigned j=0;j<cnt;j++){ e8((uint8_t)val); pc++; }
             free(lines2[i]); continue;
         }
+        if(!strcmp(tok,"ALIGN")){
+            uint32_t n=line_sz(lines2[i], pc);
+            for(uint32_t j=0;j<n;j++){ e8(0x90); pc++; }
+            free(lines2[i]); continue;
+        }
         if(!strcmp(tok,"INT")){
             unsigned imm=parseImm(strtok_r(NULL," \t,",&save), i);
             if(imm>0xFF) dieAsm(i,"INT imm8 out of range: %u",imm);
@@ -575,8 +2570,17 @@ static void asm_passB() {
         if(!strcmp(tok,"JMP")||!strcmp(tok,"CALL")){
             e8(tok[0]=='J'?0xE9:0xE8);
             uint32_t dest=find_lbl(strtok_r(NULL," \t,",&save), i);
-            int32_t rel=(int32_t)dest-(int32_t)(pc+5);
-            e32((uint32_t)rel); pc+=5;
+            // pm32: rel32
+            if(pm32){ e32(dest-(pc+5)); pc+=5; free(lines2[i]); continue; }
+            e16((uint16_t)(dest-(pc+3))); pc+=3;
+            free(lines2[i]); continue;
+        }
+        if(jccOp(tok)>=0){
+            char *t=strtok_r(NULL," \t,",&save);
+            long rel = isdigit((unsigned char)*t)||*t=='-'||*t=='+' ? strtol(t,NULL,0)
+                     : (long)find_lbl(t,i)-(long)(pc+2);
+            if(rel<-128||rel>127) dieAsm(i,"short branch out of range: %ld",rel);
+            e8((uint8_t)jccOp(tok)); e8((uint8_t)rel); pc+=2;
             free(lines2[i]); continue;
         }
         if(!strcmp(tok,"LJMP")){
@@ -584,7 +2588,8 @@ static void asm_passB() {
             char *p = strtok_r(NULL," \t,",&save);
             char *sg = strchr(p,':'); *sg++=0;
             unsigned off=parseImm(p,i), s=parseImm(sg,i);
-            e32(off); e16((uint16_t)s); pc+=6;
+            if(pm32){ e32(off); e16((uint16_t)s); pc+=7; free(lines2[i]); continue; }
+            e16((uint16_t)off); e16((uint16_t)s); pc+=5;
             free(lines2[i]); continue;
         }
         if(tok[strlen(tok)-1]==':'){
@@ -592,385 +2597,1843 @@ static void asm_passB() {
         }
         dieAsm(i,"unknown directive '%s'", tok);
     }
+    for(int k=0;k<ncrc;k++){
+        uint32_t n=crcFix[k].e-crcFix[k].a;
+        uint8_t *b=(uint8_t*)calloc(n?n:1,1);
+        if(!b) die("out of memory");
+        fflush(out); fseek(out,crcFix[k].a,SEEK_SET);
+        if(fread(b,1,n,out)!=n) die("cannot read back patch payload");
+        fseek(out,crcFix[k].at,SEEK_SET); e32(crc32(b,n));
+        free(b);
+    }
     fclose(out);
 }
 
-int main(int argc,char**argv){
-    if(argc!=2){
-        fprintf(stderr,"Usage: %s <source.asm>\n",argv[0]);
-        return 1;
-    }
-    read_src(argv[1]);
-    pass1();
-    asm_passA();
-    asm_passB();
-    return 0;
-}/*
-  tri.c – Python-Style “Trinary-Assembly” Compiler
-  ~380 LOC ANSI C → <6 KB binary with –Os –s + strip + upx
+/* Delta patches: rewrite the old image into the new one as one
+   patch_bank()..patch_commit(auto) record per changed bank.  Bytes that
+   already match stay; runs found anywhere in the old image (rolling hash
+   over DIFF_BLK-byte blocks, extended both ways) become COPY hunks, the
+   rest DATA hunks.  DATA absorbs unchanged gaps shorter than its header.
+   A COPY never reads bytes an earlier hunk has rewritten; banks go in
+   whichever order gives the smaller payload. */
+#define DIFF_BLK  16
+#define DIFF_COPY 16     // shortest COPY worth its 9-byte header
+#define DIFF_GAP  5      // DATA header size
+#define H_COPY    2
+#define H_DATA    1
+typedef struct { int type; uint32_t dst, len, src; } Hunk;
+static uint32_t bankSize = 0x1000;
 
-  Fixes & hardening:
-    • Array-bounds checks on all indices
-    • Scope-based borrow checking with matching braces
-    • Duplicate-label detection
-    • Malformed numeric literals error with source context
-    • Unrecognized directives/instructions error with context
-    • Error messages include source-line number & text
-    • Non-destructive parsing via strtok_r
-    • Malloc-return checks, with casts to (char*)
-    • Free(lines2[]) to avoid leaks
-*/
+static uint8_t *readImage(const char *fn, uint32_t *n) {
+    FILE *f = fopen(fn,"rb");
+    if (!f) die("cannot open image '%s'", fn);
+    fseek(f, 0, SEEK_END); long sz = ftell(f); fseek(f, 0, SEEK_SET);
+    uint8_t *b = (uint8_t*)malloc(sz ? sz : 1);
+    if (!b || fread(b, 1, sz, f)!=(size_t)sz) die("cannot read image '%s'", fn);
+    fclose(f);
+    *n = (uint32_t)sz;
+    return b;
+}
 
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <stdint.h>
-#include <stdarg.h>
-#include <ctype.h>
+static uint32_t blkHash(const uint8_t *p) {
+    uint32_t h = 0;
+    for (int k=0; k<DIFF_BLK; k++) h = h*257 + p[k];
+    return h;
+}
 
-#define MAXL 512
-#define LNSZ  80
-#define MAXLB 128
-#define MAXS  16
+/* Write patch bytes as db() lines, with fill() for runs */
+static int diffBytes(FILE *f, const uint8_t *b, uint32_t n) {
+    int lines = 0;
+    for (uint32_t k=0; k<n; ) {
+        uint32_t r = 1;
+        while (k+r<n && b[k+r]==b[k]) r++;
+        if (r>=8) { fprintf(f,"fill(0x%X, 0x%02X)\n", r, b[k]); k += r; lines++; continue; }
+        fprintf(f,"db(");
+        for (uint32_t j=0; j<12 && k<n; j++, k++) fprintf(f, j ? ", 0x%02X" : "0x%02X", b[k]);
+        fprintf(f,")\n"); lines++;
+    }
+    return lines;
+}
 
-typedef struct { char name[16]; uint32_t addr; } Label;
-typedef struct { int bm, bi; } BorrowFrame;
+static void addHunk(Hunk *h, int *nh, int type, uint32_t dst, uint32_t len, uint32_t src) {
+    Hunk *l = *nh ? &h[*nh-1] : NULL;
+    if (type==H_DATA && l && l->type==H_DATA && dst-(l->dst+l->len)<DIFF_GAP
+        && dst+len-l->dst<=0xFFFF) { l->len = dst+len-l->dst; return; }
+    Hunk x = { type, dst, len, src };
+    h[(*nh)++] = x;
+}
 
-// DSL source lines
-static char src[MAXL][LNSZ];
-static int  sl = 0;
+/* Plan all banks, ascending or (down) descending.  A forward shift can
+   only be copied when higher banks are rewritten first.  Each bank starts
+   with a marker hunk of type 0.  Returns the payload size. */
+static uint32_t diffPlan(const uint8_t *od, uint32_t on, const uint8_t *nw, uint32_t nn,
+                         const int *head, const int *nxt, uint8_t *dirty, int down,
+                         Hunk *h, int *nh) {
+    uint32_t pay = 0, hv = 0, hp = (uint32_t)-1, pw = 1, nbk = (nn+bankSize-1)/bankSize;
+    for (int k=1; k<DIFF_BLK; k++) pw *= 257;
+    memset(dirty, 0, on>nn ? on : nn+1);
+    *nh = 0;
+    for (uint32_t bk=0; bk<nbk; bk++) {
+        uint32_t b0 = (down ? nbk-1-bk : bk)*bankSize;
+        uint32_t b1 = nn-b0<bankSize ? nn : b0+bankSize, i = b0, lit = (uint32_t)-1;
+        int h0 = *nh;
+        addHunk(h, nh, 0, b0, 0, 0);
+        while (i<b1) {
+            if (i<on && nw[i]==od[i]) {
+                if (lit!=(uint32_t)-1) { addHunk(h, nh, H_DATA, lit, i-lit, 0); lit = (uint32_t)-1; }
+                i++; continue;
+            }
+            uint32_t bl = 0, bs = 0, bb = 0;
+            if (i+DIFF_BLK<=nn) {
+                hv = i && hp==i-1 ? (hv-nw[i-1]*pw)*257 + nw[i+DIFF_BLK-1] : blkHash(nw+i);
+                hp = i;
+                for (int c=head[hv&0xFFFF]; c>=0; c=nxt[c]) {
+                    uint32_t s = (uint32_t)c*DIFF_BLK, l = 0, back = 0, x;
+                    while (i+l<b1 && s+l<on && nw[i+l]==od[s+l]) l++;
+                    if (l<DIFF_BLK) continue;
+                    while (lit!=(uint32_t)-1 && i-back>lit && s-back>0 && nw[i-back-1]==od[s-back-1]) back++;
+                    for (x=s-back; x<s+l && !(dirty[x] && (x<i-back || x>=i+l)); x++) ;
+                    if (x==s+l && l+back>bl) { bl = l+back; bs = s-back; bb = back; }
+                }
+            }
+            if (bl>=DIFF_COPY) {
+                uint32_t d = i-bb;
+                if (lit!=(uint32_t)-1 && d>lit) addHunk(h, nh, H_DATA, lit, d-lit, 0);
+                lit = (uint32_t)-1;
+                for (uint32_t x=d; x<d+bl; x+=0xFFFF)
+                    addHunk(h, nh, H_COPY, x, d+bl-x<0xFFFF ? d+bl-x : 0xFFFF, bs+(x-d));
+                memset(dirty+d, 1, bl);
+                i = d+bl;
+                continue;
+            }
+            if (lit==(uint32_t)-1) lit = i;
+            else if (i-lit==0xFFFF) { addHunk(h, nh, H_DATA, lit, i-lit, 0); lit = i; }
+            dirty[i++] = 1;
+        }
+        if (lit!=(uint32_t)-1) addHunk(h, nh, H_DATA, lit, i-lit, 0);
+        if (*nh==h0+1) { (*nh)--; continue; }     // bank unchanged
+        for (int k=h0+1; k<*nh; k++) pay += h[k].type==H_COPY ? 9 : 5+h[k].len;
+    }
+    return pay;
+}
 
-// Intermediate AST→ASM lines + source mapping
-static char asm1[MAXL][LNSZ];
-static int  asmSrcLine[MAXL];
-static int  al = 0;
+static void diffImages(const char *ofn, const char *nfn, const char *pfn) {
+    uint32_t on, nn;
+    uint8_t *od = readImage(ofn, &on), *nw = readImage(nfn, &nn);
+    uint32_t nb = on/DIFF_BLK, nbk = (nn+bankSize-1)/bankSize;
+    if (nbk>256) die("image needs more than 256 banks of 0x%X", bankSize);
+    int *head = (int*)malloc(sizeof(int)*0x10000), *nxt = (int*)malloc(sizeof(int)*(nb+1)), nh[2];
+    uint8_t *dirty = (uint8_t*)malloc(on>nn ? on : nn+1);
+    Hunk *h[2] = { (Hunk*)malloc(sizeof(Hunk)*(nn+nbk+1)), (Hunk*)malloc(sizeof(Hunk)*(nn+nbk+1)) };
+    if (!head || !nxt || !dirty || !h[0] || !h[1]) die("out of memory");
+    memset(head, -1, sizeof(int)*0x10000);
+    for (uint32_t c=nb; c-->0; ) {
+        uint32_t k = blkHash(od+c*DIFF_BLK)&0xFFFF;
+        nxt[c] = head[k]; head[k] = (int)c;
+    }
+    uint32_t up = diffPlan(od, on, nw, nn, head, nxt, dirty, 0, h[0], &nh[0]);
+    uint32_t dn = diffPlan(od, on, nw, nn, head, nxt, dirty, 1, h[1], &nh[1]);
+    int d = dn<up, nbank = 0, ndata = 0, ncopy = 0, lines = 3;
+    FILE *f = fopen(pfn,"w");
+    if (!f) die("cannot create '%s'", pfn);
+    fprintf(f,"; Tri delta patch: %s -> %s, banks of 0x%X\n", ofn, nfn, bankSize);
+    fprintf(f,"; DATA: db(1, off lo, off hi, len lo, len hi) + len bytes\n");
+    fprintf(f,"; COPY: db(2, off lo, off hi, len lo, len hi, src as 4 bytes LE)\n");
+    uint32_t b0 = 0;
+    for (int k=0; k<nh[d]; k++) {
+        const Hunk *x = &h[d][k];
+        if (!x->type) {
+            if (nbank++) fprintf(f,"patch_commit(auto)\n");
+            b0 = x->dst;
+            fprintf(f,"patch_bank(%u, 0)\n", b0/bankSize); lines += 2;
+            continue;
+        }
+        uint32_t off = x->dst-b0, len = x->len;
+        fprintf(f,"db(%d, 0x%02X, 0x%02X, 0x%02X, 0x%02X", x->type, off&0xFF, off>>8, len&0xFF, len>>8);
+        if (x->type==H_COPY) {
+            fprintf(f,", 0x%02X, 0x%02X, 0x%02X, 0x%02X)\n", x->src&0xFF, x->src>>8&0xFF,
+                    x->src>>16&0xFF, x->src>>24);
+            ncopy++;
+        } else {
+            fprintf(f,")\n");
+            lines += diffBytes(f, nw+x->dst, len);
+            ndata++;
+        }
+        lines++;
+    }
+    if (nbank) fprintf(f,"patch_commit(auto)\n");
+    fclose(f);
+    fprintf(stderr,"diff: %d bank(s) %s, %d DATA and %d COPY hunk(s), payload %u of %u bytes -> %s\n",
+            nbank, d ? "high to low" : "low to high", ndata, ncopy, d ? dn : up, nn, pfn);
+    if (on>nn) fprintf(stderr,"note: diff: the old image is longer; bytes past 0x%X are left as they are\n", nn);
+    if (lines>MAXL) fprintf(stderr,"warning: %s has %d lines, more than Tri compiles (%d)\n", pfn, lines, MAXL);
+    free(od); free(nw); free(head); free(nxt); free(dirty); free(h[0]); free(h[1]);
+}
 
-// Final assembler lines + asm1 mapping
-static char *lines2[MAXL];
-static int   lines2AsmIdx[MAXL];
-static int   ln2 = 0;
+/* perf-report: decode slot tables dumped from tape, sum them over all
+   dumps and print inclusive and flat (self) time per region.  A callee
+   shared by several regions is charged to them by static call sites. */
+typedef struct { char label[LNSZ]; int first, last, used; uint64_t total, count; double self; } Region;
 
-// Borrow-scope stack
-static BorrowFrame bstack[MAXS];
-static int         sp = 0;
+static uint64_t le(const uint8_t *p, int n) {
+    uint64_t v = 0;
+    while (n--) v = v<<8 | p[n];
+    return v;
+}
 
-// Unified label table
-static Label lbl2[MAXLB];
-static int   nl2 = 0;
+/* base: the slot table's offset in the dumps; -1 takes the map's (tsc), else 0 */
+static void perfReport(const char **dumps, int nd, const char *mapfn, long base, int json) {
+    static Region rg[256];
+    static int site[256][256], into[256];
+    char buf[LNSZ*2], lab[LNSZ];
+    int evt = -1, cal = -1, a, b, c, d, ns = 0;
+    FILE *f = fopen(mapfn,"r");
+    if (!f) die("cannot open map '%s'", mapfn);
+    while (fgets(buf, sizeof buf, f)) {
+        if (sscanf(buf,"mode pmc %i", &a)==1) evt = a;
+        else if (sscanf(buf,"base %i", &a)==1 && base<0) base = a;
+        else if (sscanf(buf,"calib %d", &a)==1 && a>=0 && a<256) { cal = a; if (a>=ns) ns = a+1; }
+        else if (sscanf(buf,"slot %d %79s %d %d", &a, lab, &c, &d)==4 && a>=0 && a<256) {
+            strcpy(rg[a].label, lab); rg[a].first = c; rg[a].last = d; rg[a].used = 1;
+            if (a>=ns) ns = a+1;
+        }
+        else if (sscanf(buf,"call %d %d", &a, &b)==2 && a>=0 && a<256 && b>=0 && b<256 && a!=b) {
+            site[a][b]++; into[b]++;
+        }
+    }
+    fclose(f);
+    if (base<0) base = 0;
+    for (int k=0; k<nd; k++) {
+        uint32_t n;
+        uint8_t *img = readImage(dumps[k], &n);
+        if (n<base+ns*SLOT_SZ) die("%s: %u bytes, slot table needs %u", dumps[k], n, (unsigned)(base+ns*SLOT_SZ));
+        for (int x=0; x<ns; x++) {
+            const uint8_t *r = img+base+x*SLOT_SZ;
+            uint32_t cnt = (uint32_t)le(r+8, 4);
+            if (cnt && evt>=0 && x!=cal && le(r+12, 4)!=(uint32_t)evt)
+                fprintf(stderr,"warning: %s slot %d counted event 0x%X, map says 0x%X\n",
+                        dumps[k], x, (unsigned)le(r+12, 4), evt);
+            rg[x].total += le(r, 8); rg[x].count += cnt;
+        }
+        free(img);
+    }
+    if (cal>=0 && rg[cal].count) {
+        // each sample carries the timer's own cost; the calibration slot measured it
+        uint64_t ovh = rg[cal].total/rg[cal].count;
+        for (int x=0; x<ns; x++)
+            rg[x].total = rg[x].total>ovh*rg[x].count ? rg[x].total-ovh*rg[x].count : 0;
+        if (!json) printf("TSC overhead: %llu cycles per sample, subtracted\n", (unsigned long long)ovh);
+    }
+    double all = 0;
+    for (int x=0; x<ns; x++) {
+        if (!rg[x].used) continue;
+        rg[x].self = (double)rg[x].total;
+        for (int y=0; y<ns; y++)
+            if (site[x][y]) rg[x].self -= (double)rg[y].total*site[x][y]/into[y];
+        if (rg[x].self<0) rg[x].self = 0;
+        all += rg[x].self;
+    }
+    static int ord[256];
+    for (int x=0; x<ns; x++) ord[x] = x;
+    if (json) {
+        printf("{\"mode\": \"%s\", \"event\": %d, \"dumps\": %d, \"regions\": [",
+               cal>=0 ? "tsc" : "pmc", evt, nd);
+        for (int x=0, sep=0; x<ns; x++) {
+            Region *r = &rg[x];
+            if (!r->used) continue;
+            printf("%s\n  {\"slot\": %d, \"label\": \"%s\", \"first\": %d, \"last\": %d, "
+                   "\"count\": %llu, \"total\": %llu, \"self\": %.0f}", sep++ ? "," : "", x, r->label,
+                   r->first, r->last, (unsigned long long)r->count, (unsigned long long)r->total, r->self);
+        }
+        printf("\n]}\n");
+        return;
+    }
+    for (int pass=0; pass<2; pass++) {
+        for (int x=1; x<ns; x++)          // by self, then by total, descending
+            for (int y=x; y>0; y--) {
+                const Region *p = &rg[ord[y-1]], *q = &rg[ord[y]];
+                if (pass ? p->total>=q->total : p->self>=q->self) break;
+                int t = ord[y]; ord[y] = ord[y-1]; ord[y-1] = t;
+            }
+        if (pass) printf("\nInclusive profile\n");
+        else if (cal>=0) printf("Flat profile: TSC cycles, %d dump(s)\n", nd);
+        else printf("Flat profile: event 0x%02X, %d dump(s)\n", evt, nd);
+        printf("  %6s %14s %14s %10s %12s  %s\n", "self%", pass ? "total" : "self",
+               pass ? "self" : "total", "count", "per count", "region");
+        for (int z=0; z<ns; z++) {
+            const Region *r = &rg[ord[z]];
+            if (!r->used) continue;
+            printf("  %5.1f%% %14.0f %14.0f %10llu %12.1f  %s (lines %d-%d)\n",
+                   all ? 100*r->self/all : 0.0, pass ? (double)r->total : r->self,
+                   pass ? r->self : (double)r->total, (unsigned long long)r->count,
+                   r->count ? (double)r->total/r->count : 0.0, r->label, r->first, r->last);
+        }
+    }
+}
 
-// Output file
-static FILE *out;
+/* tri run: a 16-bit real-mode emulator for Tri images.  It covers the
+   instructions Tri emits plus the common 8086/386 forms found in db()
+   code; every intrinsic vector is served by a model that decodes the
+   operand bytes exactly as pass1 lays them out, applies the side effect
+   and charges the intrinsic's latency.  Models are looked up per vector
+   and can be swapped with --model vec=name. */
+#define MEMSZ 0x110000
+#define F_CF 0x001
+#define F_PF 0x004
+#define F_AF 0x010
+#define F_ZF 0x040
+#define F_SF 0x080
+#define F_IF 0x200
+#define F_DF 0x400
+#define F_OF 0x800
+enum { R_AX, R_CX, R_DX, R_BX, R_SP, R_BP, R_SI, R_DI };
+enum { S_ES, S_CS, S_SS, S_DS };
 
-/* Trim whitespace & CR/LF */
-static char *trim(char *s) {
-    while (*s==' '||*s=='\t') s++;
-    char *e = s + strlen(s)-1;
-    while (e>=s && (*e==' '||*e=='\t'||*e=='\r'||*e=='\n')) *e--=0;
-    return s;
+typedef struct {
+    uint32_t r[8];
+    uint16_t sr[4], ip;
+    uint32_t fl;
+    uint64_t icount, cycles;
+    uint64_t taken, rd, wr, ntrap;    // virtual PMCs, see counter()
+    int      halt;
+} Cpu;
+
+// Hardware state behind the intrinsics
+typedef struct {
+    uint8_t  pw[256], fold, smt[256], link[256][2];
+    uint64_t bistDone[256], engBusy[16];
+    uint8_t  bistRes[256];
+    uint32_t mmeSrc, mmeDst, org, pbAt, pbBank, patchOk, patchBad;
+    uint64_t traps[256];
+} Hw;
+
+/* Machine state is per thread so batch jobs (see runBatch) can run side
+   by side; models, handlers and latencies are shared and read-only. */
+static __thread Cpu cpu;
+static __thread Hw  hw;
+static __thread uint8_t *mem;
+static __thread int memMapped;           // mem is a private mapping of a snapshot
+static __thread const char *emuStop;
+static __thread uint64_t emuMax;         // instruction limit of the current run
+static __thread uint32_t jobLat[NINTR];  // per-job --lat, over latSet
+static __thread char *ttyBuf;            // batch jobs collect tty output here
+static __thread int ttyN;
+static uint32_t runEntry = 0xFFFFFFFF, runUntil = 0xFFFFFFFF;
+static uint64_t runMax = 10000000;
+static int runStep = 0;          // --step: reference interpreter, no op cache
+static int runCheck = 0;         // --check: rerun under --step and compare
+
+static uint32_t lin(int s, uint32_t off) { return ((uint32_t)cpu.sr[s]<<4) + (off&0xFFFF); }
+static uint32_t rdm(uint32_t a, int sz) {
+    uint32_t v = 0;
+    for (int k=sz; k-->0; ) v = v<<8 | mem[(a+k)%MEMSZ];
+    return v;
 }
+/* Micro-op cache (see runFast): one Uop per linear address, 4 KB pages
+   allocated on first decode.  codePg marks pages holding decoded ops so
+   a data write costs one test unless it lands on code. */
+#define UPG 12
+typedef struct { uint8_t h, len, n, r; uint16_t imm, imm2; } Uop;   // n: instructions covered
+static __thread Uop    *ucache[MEMSZ>>UPG];
+static __thread uint8_t codePg[MEMSZ>>UPG];
 
-/* General error */
-static void die(const char *fmt, ...) {
-    va_list ap; va_start(ap, fmt);
-    vfprintf(stderr, fmt, ap);
-    va_end(ap);
-    fprintf(stderr, "\n");
-    exit(1);
+/* Self-modifying write of [a,a+n): drop every op that overlaps it */
+static void smc(uint32_t a, uint32_t n) {
+    for (uint32_t x = a>15 ? a-15 : 0; x<a+n && x<MEMSZ; x++) {
+        Uop *u = codePg[x>>UPG] ? &ucache[x>>UPG][x&((1<<UPG)-1)] : NULL;
+        if (u && u->h && x+u->len>a) u->h = 0;
+    }
 }
 
-/* Error in DSL source */
-static void dieSrc(int idx, const char *fmt, ...) {
-    fprintf(stderr,"Error at source line %d: ", idx+1);
-    va_list ap; va_start(ap, fmt);
-    vfprintf(stderr, fmt, ap);
-    va_end(ap);
-    fprintf(stderr,"\n    %s\n", src[idx]);
-    exit(1);
+static void wrm(uint32_t a, uint32_t v, int sz) {
+    for (int k=0; k<sz; k++, v>>=8) mem[(a+k)%MEMSZ] = (uint8_t)v;
+    if (codePg[a%MEMSZ>>UPG] | codePg[(a+sz-1)%MEMSZ>>UPG]) smc(a, sz);
+}
+static uint32_t fetch(int sz) {
+    uint32_t v = rdm(lin(S_CS, cpu.ip), sz);
+    cpu.ip += sz;
+    return v;
+}
+static uint32_t rdr(int sz, int r) {
+    if (sz==1) return r<4 ? cpu.r[r]&0xFF : cpu.r[r-4]>>8&0xFF;
+    return sz==2 ? cpu.r[r]&0xFFFF : cpu.r[r];
+}
+static void wrr(int sz, int r, uint32_t v) {
+    if (sz==1) {
+        if (r<4) cpu.r[r] = (cpu.r[r]&~0xFFu) | (v&0xFF);
+        else cpu.r[r-4] = (cpu.r[r-4]&~0xFF00u) | (v&0xFF)<<8;
+    } else if (sz==2) cpu.r[r] = (cpu.r[r]&~0xFFFFu) | (v&0xFFFF);
+    else cpu.r[r] = v;
+}
+static void push(uint32_t v, int sz) {
+    cpu.wr++;
+    wrr(2, R_SP, cpu.r[R_SP]-sz);
+    wrm(lin(S_SS, cpu.r[R_SP]), v, sz);
+}
+static uint32_t pop(int sz) {
+    cpu.rd++;
+    uint32_t v = rdm(lin(S_SS, cpu.r[R_SP]), sz);
+    wrr(2, R_SP, cpu.r[R_SP]+sz);
+    return v;
 }
 
-/* Error in assembler stage */
-static void dieAsm(int aidx, const char *fmt, ...) {
-    int sidx = asmSrcLine[ lines2AsmIdx[aidx] ];
-    fprintf(stderr,"Error at source line %d: ", sidx+1);
-    va_list ap; va_start(ap, fmt);
-    vfprintf(stderr, fmt, ap);
-    va_end(ap);
-    fprintf(stderr,"\n    %s\n", src[sidx]);
-    exit(1);
+/* ModRM with 16-bit addressing; seg is the override or -1 */
+typedef struct { int mod, reg, rm; uint32_t off, a; } ModRM;
+static ModRM modrm(int seg) {
+    static const int base[8][2] = { {R_BX,R_SI},{R_BX,R_DI},{R_BP,R_SI},{R_BP,R_DI},
+                                    {R_SI,-1},{R_DI,-1},{R_BP,-1},{R_BX,-1} };
+    uint8_t b = (uint8_t)fetch(1);
+    ModRM m = { b>>6, b>>3&7, b&7, 0, 0 };
+    if (m.mod==3) return m;
+    uint32_t off = 0; int ss = 0;
+    if (m.mod==0 && m.rm==6) off = fetch(2);
+    else {
+        off = cpu.r[base[m.rm][0]] + (base[m.rm][1]>=0 ? cpu.r[base[m.rm][1]] : 0);
+        ss = base[m.rm][0]==R_BP;
+        if (m.mod==1) off += (uint32_t)(int8_t)fetch(1);
+        else if (m.mod==2) off += fetch(2);
+    }
+    m.off = off&0xFFFF;
+    m.a = lin(seg>=0 ? seg : ss ? S_SS : S_DS, off);
+    return m;
 }
+static uint32_t rdE(const ModRM *m, int sz) { return m->mod==3 ? rdr(sz, m->rm) : (cpu.rd++, rdm(m->a, sz)); }
+static void wrE(const ModRM *m, int sz, uint32_t v) { if (m->mod==3) wrr(sz, m->rm, v); else { cpu.wr++; wrm(m->a, v, sz); } }
 
-/* Parse immediate with validation */
-static unsigned parseImm(const char *s, int aidx) {
-    char *end;
-    unsigned long v;
-    if (s[0]=='0'&&s[1]=='x') {
-        v = strtoul(s+2, &end, 16);
-        if (end==s+2 || *end) dieAsm(aidx,"malformed hex immediate '%s'",s);
-    } else {
-        v = strtoul(s, &end, 10);
-        if (end==s) dieAsm(aidx,"malformed decimal immediate '%s'",s);
+static uint32_t szMask(int sz) { return sz==4 ? 0xFFFFFFFFu : (1u<<8*sz)-1; }
+static void setSZP(uint32_t r, int sz) {
+    r &= szMask(sz);
+    cpu.fl &= ~(F_ZF|F_SF|F_PF);
+    if (!r) cpu.fl |= F_ZF;
+    if (r>>(8*sz-1)&1) cpu.fl |= F_SF;
+    if (!__builtin_parity(r&0xFF)) cpu.fl |= F_PF;
+}
+
+/* ADD OR ADC SBB AND SUB XOR CMP, in opcode order */
+static uint32_t alu(int op, uint32_t a, uint32_t b, int sz) {
+    uint32_t m = szMask(sz), top = 1u<<(8*sz-1), c = cpu.fl&F_CF ? 1 : 0, r;
+    uint64_t w;
+    a &= m; b &= m;
+    switch (op) {
+    case 1: r = a|b; goto logic;
+    case 4: r = a&b; goto logic;
+    case 6: r = a^b;
+    logic:
+        cpu.fl &= ~(F_CF|F_OF|F_AF); setSZP(r, sz); return r;
+    case 0: case 2:
+        if (op==0) c = 0;
+        w = (uint64_t)a+b+c; r = (uint32_t)w&m;
+        cpu.fl &= ~(F_CF|F_OF|F_AF);
+        if (w>m) cpu.fl |= F_CF;
+        if (~(a^b)&(a^r)&top) cpu.fl |= F_OF;
+        break;
+    default:   // 3 SBB, 5 SUB, 7 CMP
+        if (op!=3) c = 0;
+        w = (uint64_t)a-b-c; r = (uint32_t)w&m;
+        cpu.fl &= ~(F_CF|F_OF|F_AF);
+        if ((uint64_t)b+c>a) cpu.fl |= F_CF;
+        if ((a^b)&(a^r)&top) cpu.fl |= F_OF;
+        break;
     }
-    return (unsigned)v;
+    if ((a^b^r)&0x10) cpu.fl |= F_AF;
+    setSZP(r, sz);
+    return r;
 }
 
-/* Read DSL source lines */
-static void read_src(const char *fn) {
-    FILE *f = fopen(fn,"r");
-    if (!f) die("cannot open source '%s'", fn);
-    char buf[LNSZ];
-    while (fgets(buf,LNSZ,f)) {
-        char *t = trim(buf);
-        if (*t && *t!=';') {
-            if (sl>=MAXL) die("too many source lines (> %d)", MAXL);
-            strcpy(src[sl++], t);
+static uint32_t shift(int op, uint32_t v, int n, int sz) {
+    uint32_t m = szMask(sz), top = 1u<<(8*sz-1);
+    n &= 0x1F;
+    if (!n) return v;
+    v &= m;
+    for (int k=0; k<n; k++) {
+        uint32_t cf;
+        switch (op) {
+        case 0: cf = v&top ? 1 : 0; v = (v<<1|cf)&m; break;                        // ROL
+        case 1: cf = v&1; v = v>>1 | (cf ? top : 0); break;                         // ROR
+        case 2: cf = v&top ? 1 : 0; v = (v<<1|(cpu.fl&F_CF ? 1 : 0))&m; break;    // RCL
+        case 3: cf = v&1; v = v>>1 | (cpu.fl&F_CF ? top : 0); break;               // RCR
+        case 4: case 6: cf = v&top ? 1 : 0; v = v<<1&m; break;                    // SHL
+        case 5: cf = v&1; v >>= 1; break;                                           // SHR
+        default: cf = v&1; v = v>>1 | (v&top); break;                               // SAR
         }
+        cpu.fl = (cpu.fl&~F_CF) | cf;
     }
-    fclose(f);
+    if (op>=4) setSZP(v, sz);
+    cpu.fl &= ~F_OF;
+    if ((op==0||op==2||op==4||op==6) && ((v&top ? 1 : 0) ^ (cpu.fl&F_CF))) cpu.fl |= F_OF;
+    return v;
 }
 
-/* Compute size of a single asm1 line */
-static uint32_t line_sz(const char *ln) {
-    char tmp[LNSZ]; strcpy(tmp, ln);
-    char *tok = strtok(tmp," \t,");
-    if (!tok) return 0;
-    if (tok[strlen(tok)-1]==':') return 0;
-    if (!strcmp(tok,"ORG"))   return 0;
-    if (!strcmp(tok,"DB")) {
-        int c=0; while(strtok(NULL," \t,")) c++; return c;
+static int cond(int cc) {
+    int f = cpu.fl, r;
+    switch (cc>>1) {
+    case 0: r = f&F_OF; break;
+    case 1: r = f&F_CF; break;
+    case 2: r = f&F_ZF; break;
+    case 3: r = f&(F_CF|F_ZF); break;
+    case 4: r = f&F_SF; break;
+    case 5: r = f&F_PF; break;
+    case 6: r = !(f&F_SF) != !(f&F_OF); break;
+    default: r = (f&F_ZF) || (!(f&F_SF) != !(f&F_OF)); break;
     }
-    if (!strcmp(tok,"FILL")) {
-        int n = atoi(strtok(NULL," \t,")); return n;
+    return (r ? 1 : 0) ^ (cc&1);
+}
+
+/* --- intrinsic models --------------------------------------------------- */
+
+/* Operand length of the op for vector v whose bytes start at p */
+static int modelLen(int v, uint32_t p) {
+    int k = intrByVec((uint8_t)v);
+    if (v==0x30) return MME_DSZ;
+    if (v==0x04) return 4;
+    if (v==0x60) {
+        uint32_t q = p+4;
+        for (int n=mem[p]; n>0; n--) q += (4+mem[q+1]+3)&~3u;
+        return (int)(q-p);
     }
-    if (!strcmp(tok,"INT"))   return 2;
-    if (!strcmp(tok,"JMP")||!strcmp(tok,"CALL")) return 5;
-    if (!strcmp(tok,"LJMP"))  return 6;
-    return 0;
+    return k>=0 ? intrTab[k].nargs : 0;
 }
 
-/* Record a label, error on duplicate */
-static void recordLabel(const char *nm, uint32_t pc, int aidx) {
-    for(int i=0;i<nl2;i++){
-        if(!strcmp(lbl2[i].name, nm))
-            dieAsm(aidx,"duplicate label '%s'", nm);
+static void trap(int v) { hw.traps[v]++; cpu.ntrap++; }
+
+static uint32_t modelLat(int v) {
+    int k = intrByVec((uint8_t)v);
+    return k<0 ? 0 : jobLat[k] ? jobLat[k] : intrLat(k);
+}
+
+/* Charge the trap; async work finishes in the background, one job per engine */
+static void charge(int v, uint32_t extra) {
+    int k = intrByVec((uint8_t)v);
+    uint64_t *busy = &hw.engBusy[v>>4];
+    cpu.cycles += CYC_TRAP;
+    if (k>=0 && intrTab[k].flags&IF_ASYNC) {
+        if (*busy>cpu.cycles) cpu.cycles = *busy;          // engine still on the last job
+        *busy = cpu.cycles + modelLat(v) + extra;
+    } else cpu.cycles += modelLat(v) + extra;
+}
+
+typedef void (*Model)(int v, uint32_t p);
+/* Virtual PMCs: perf_sample's event byte picks one.  Codes follow the
+   x86 architectural events where there is one: 0x3C cycles, 0xC0
+   instructions, 0xC4 taken branches; then 0xD0/0xD1 data reads/writes
+   and 0xCD intrinsic traps. */
+static __thread uint8_t pmcWarned[256];
+static uint64_t counter(int evt) {
+    switch (evt) {
+    case 0x3C: return cpu.cycles;
+    case 0xC0: return cpu.icount;
+    case 0xC4: return cpu.taken;
+    case 0xD0: return cpu.rd;
+    case 0xD1: return cpu.wr;
+    case 0xCD: return cpu.ntrap;
     }
-    if(nl2>=MAXLB) dieAsm(aidx,"too many labels (> %d)", MAXLB);
-    strncpy(lbl2[nl2].name, nm, 15);
-    lbl2[nl2].name[15] = 0;
-    lbl2[nl2].addr = pc;
-    nl2++;
+    if (!pmcWarned[evt]++) fprintf(stderr,"warning: run: no virtual PMC for event 0x%02X, counting cycles\n", evt);
+    return cpu.cycles;
 }
 
-/* Lookup a label */
-static uint32_t find_lbl(const char *nm, int aidx) {
-    for(int i=0;i<nl2;i++){
-        if(!strcmp(lbl2[i].name, nm))
-            return lbl2[i].addr;
+static void mFold(int v, uint32_t p)  { hw.fold = mem[p]; charge(v, 0); }
+static void mGate(int v, uint32_t p)  { hw.pw[mem[p]] = mem[p+1]; charge(v, 0); }
+static void mOrg(int v, uint32_t p)   { hw.org = mem[p]; charge(v, 0); }
+static void mSmt(int v, uint32_t p)   { hw.smt[mem[p]] = mem[p+1]; charge(v, 0); }
+static void mLink(int v, uint32_t p)  { hw.link[mem[p]][0] = mem[p+1]; hw.link[mem[p]][1] = mem[p+2]; charge(v, 0); }
+static void mBist(int v, uint32_t p) {
+    charge(v, 0);
+    hw.bistDone[mem[p]] = cpu.cycles + modelLat(v);
+    hw.bistRes[mem[p]] = 1;                                  // pass
+}
+static void mBistStatus(int v, uint32_t p) {
+    charge(v, 0);
+    int id = mem[p];
+    wrr(1, R_AX, !hw.bistRes[id] ? 0x80 : cpu.cycles>=hw.bistDone[id] ? hw.bistRes[id] : 0);
+}
+static void mMme(int v, uint32_t p) {
+    uint32_t sc = (uint32_t)rdm(p, 2), dc = (uint32_t)rdm(p+2, 2), n = rdm(p+4, 4);
+    uint32_t ss = (uint32_t)rdm(p+8, 2), ds = (uint32_t)rdm(p+10, 2), fl = (uint32_t)rdm(p+12, 2);
+    uint32_t mask = rdm(p+16, 4), s = fl&MME_CHAIN ? hw.mmeSrc : sc<<4, d = fl&MME_CHAIN ? hw.mmeDst : dc<<4;
+    if (mask<=0xFF) mask *= 0x01010101;
+    for (uint32_t k=0; k<n; k++) {
+        uint8_t mb = (uint8_t)(mask>>8*(k&3)), *o = &mem[(d+k*(ds?ds:1))%MEMSZ];
+        *o = (uint8_t)((mem[(s+k*(ss?ss:1))%MEMSZ]&mb) | (*o&~mb));
+    }
+    hw.mmeSrc = s+n*(ss?ss:1); hw.mmeDst = d+n*(ds?ds:1);
+    smc(d, n*(ds?ds:1));
+    charge(v, n/4);
+}
+static void mPerf(int v, uint32_t p) {
+    uint32_t a = timerBase + mem[p+2]*SLOT_SZ;
+    charge(v, 0);
+    uint64_t c = counter(mem[p+1]);
+    if (mem[p]==PERF_START) { wrm(a+12, mem[p+1], 4); wrm(a+16, (uint32_t)c, 4); wrm(a+20, (uint32_t)(c>>32), 4); }
+    else if (mem[p]==PERF_STOP) {
+        uint64_t t = rdm(a, 4) | (uint64_t)rdm(a+4, 4)<<32, l = rdm(a+16, 4) | (uint64_t)rdm(a+20, 4)<<32;
+        t += c-l;
+        wrm(a, (uint32_t)t, 4); wrm(a+4, (uint32_t)(t>>32), 4); wrm(a+8, rdm(a+8, 4)+1, 4);
     }
-    dieAsm(aidx,"undefined label '%s'", nm);
-    return 0;
 }
 
-/* PASS1: DSL → asm1 with Python-like syntax & borrow checks */
-static void pass1() {
-    sp=0; bstack[0].bm=bstack[0].bi=0;
+/* patch_bank opens a payload that patch_commit closes: hunks (see Delta
+   Patches) are applied at bank*bankSize once the CRC checks out.  With
+   the commit inline, the bank trap consumes everything up to it as the
+   firmware does; a far-dispatched commit ends the payload at its MOV BX.
+   AL: 0 committed, 1 CRC mismatch, 2 no open bank. */
+static __thread uint32_t memTop, patchEnd, callSite;
+static void commit(uint32_t e, uint32_t crc) {
+    uint32_t a = hw.pbAt, b0 = hw.pbBank*bankSize, q;
+    if (!a) { charge(0x04, 0); wrr(1, R_AX, 2); return; }
+    hw.pbAt = 0;
+    charge(0x04, (e-a)/4);
+    if (crc32(mem+a, e-a)!=crc) { hw.patchBad++; wrr(1, R_AX, 1); return; }
+    for (q=a; q<e && (mem[q]==H_DATA || mem[q]==H_COPY); )
+        q += mem[q]==H_DATA ? 5+(uint32_t)rdm(q+3, 2) : 9;
+    for (int hunks = q==e; hunks && a<e; ) {   // a payload that is not a hunk list is only checked
+        uint32_t off = (uint32_t)rdm(a+1, 2), n = (uint32_t)rdm(a+3, 2);
+        if (mem[a]==H_DATA) { memmove(mem+b0+off, mem+a+5, n); a += 5+n; }
+        else { memmove(mem+b0+off, mem+rdm(a+5, 4), n); a += 9; }
+        smc(b0+off, n);
+    }
+    hw.patchOk++;
+    wrr(1, R_AX, 0);
+}
+static void mPatch(int v, uint32_t p) {
+    uint32_t q = p+2;
+    charge(v, 0);
+    hw.pbAt = p+2; hw.pbBank = mem[p];
+    while (q<memTop && (mem[q]==H_DATA || mem[q]==H_COPY))
+        q += mem[q]==H_DATA ? 5+(uint32_t)rdm(q+3, 2) : 9;
+    if (mem[q]!=0xCD || mem[q+1]!=0x04)
+        for (q=p+2; q+6<=memTop && !(mem[q]==0xCD && mem[q+1]==0x04); q++) ;
+    if (q+6>memTop) return;                   // commit is far-dispatched
+    trap(0x04);
+    commit(q, rdm(q+2, 4));
+    patchEnd = q+6;
+}
+static void mCommit(int v, uint32_t p) { (void)v; commit(callSite ? callSite-3 : p-2, rdm(p, 4)); }
 
-    for(int i=0;i<sl;i++){
-        char line[LNSZ];
-        strcpy(line, trim(src[i]));
+static void runModel(int v, uint32_t p);
+static void mBatch(int v, uint32_t p) {
+    uint32_t q = p+4;
+    charge(v, 0);
+    for (int n=mem[p]; n>0; n--) {
+        hw.traps[mem[q]]++;
+        runModel(mem[q], q+4);
+        q += (4+mem[q+1]+3)&~3u;
+    }
+}
 
-        char lower[LNSZ];
-        for(int j=0; line[j] && j<LNSZ; j++)
-            lower[j] = tolower((unsigned char)line[j]);
-        lower[strlen(line)] = 0;
+/* BIOS-style teletype: prints AL to stdout */
+static void mTty(int v, uint32_t p) {
+    (void)v; (void)p;
+    if (!ttyBuf) putchar(cpu.r[R_AX]&0xFF);
+    else if (ttyN<LNSZ*4-1) ttyBuf[ttyN++] = (char)cpu.r[R_AX];
+    cpu.cycles += CYC_TRAP;
+}
+static void mNop(int v, uint32_t p) { (void)p; charge(v, 0); }
 
-        // Pythonic transforms
-        if(!strncmp(lower,"org(",4) && line[strlen(line)-1]==')'){
-            line[strlen(line)-1]=0;
-            sprintf(line,"ORG %s", line+4);
+// ops: the trap is followed by intrinsic operands; vec: installed by default
+typedef struct { const char *name; Model fn; int ops, vec; } ModelDef;
+static const ModelDef modelTab[] = {
+    {"fold",   mFold,   1, 0x01}, {"gate",  mGate,  1, 0x02}, {"patch", mPatch, 1, 0x03},
+    {"commit", mCommit, 1, 0x04}, {"org",   mOrg,   1, 0x05}, {"bist",  mBist,  1, 0x10},
+    {"bist_status", mBistStatus, 1, 0x11}, {"smt", mSmt, 1, 0x20}, {"mme", mMme, 1, 0x30},
+    {"perf",   mPerf,   1, 0x40}, {"link",  mLink,  1, 0x50}, {"batch", mBatch, 1, 0x60},
+    {"nop",    mNop,    1, -1},   {"tty",   mTty,   0, -1},
+};
+#define NMODEL ((int)(sizeof modelTab/sizeof modelTab[0]))
+static const ModelDef *model[256];
+
+static const ModelDef *findModel(const char *nm) {
+    for (int k=0; k<NMODEL; k++)
+        if (!strcmp(nm, modelTab[k].name)) return &modelTab[k];
+    return NULL;
+}
+
+static void initModels() {
+    for (int k=0; k<NMODEL; k++)
+        if (modelTab[k].vec>=0) model[modelTab[k].vec] = &modelTab[k];
+}
+
+static void runModel(int v, uint32_t p) {
+    if (!model[v]) { emuStop = "unmodeled intrinsic in batch"; return; }
+    model[v]->fn(v, p);
+}
+
+/* Far-dispatch entry: operands in BL/BH, or at DS:BX for longer blocks */
+static int handlerAt(uint16_t seg, uint16_t off, int far) {
+    for (int v=0; v<256; v++)
+        if (hnd[v].set && hnd[v].off==off && (!hnd[v].far || (far && hnd[v].seg==seg))) return v;
+    return -1;
+}
+static void callModel(int v, uint32_t site) {
+    uint32_t p, n = (uint32_t)modelLen(v, lin(S_DS, cpu.r[R_BX]));
+    trap(v);
+    if (n<=2 && v!=0x60) {
+        p = MEMSZ-16;                       // scratch window past the 1MB line
+        mem[p] = cpu.r[R_BX]&0xFF; mem[p+1] = cpu.r[R_BX]>>8&0xFF;
+    } else p = lin(S_DS, cpu.r[R_BX]);
+    callSite = site;
+    if (model[v]) model[v]->fn(v, p); else emuStop = "unmodeled far handler";
+    callSite = 0;
+}
+
+/* INT n: a model serves it and resumes past the operands; otherwise the
+   IVT is used if the image installed a vector there */
+static void doInt(int v) {
+    uint32_t p = lin(S_CS, cpu.ip);
+    if (model[v]) {
+        trap(v);
+        if (!model[v]->ops) { model[v]->fn(v, p); return; }
+        int n = modelLen(v, p);
+        patchEnd = 0;
+        model[v]->fn(v, p);
+        cpu.ip = patchEnd ? (uint16_t)(cpu.ip + (patchEnd-p)) : (uint16_t)(cpu.ip + n);
+        return;
+    }
+    uint32_t iv = rdm((uint32_t)v*4, 4);
+    if (!iv) { emuStop = "unmodeled INT"; cpu.ip -= 2; return; }
+    push(cpu.fl, 2); push(cpu.sr[S_CS], 2); push(cpu.ip, 2);
+    cpu.fl &= ~F_IF;
+    cpu.ip = (uint16_t)iv; cpu.sr[S_CS] = (uint16_t)(iv>>16); cpu.taken++;
+    cpu.cycles += CYC_TRAP;
+}
+
+/* --- CPU ---------------------------------------------------------------- */
+
+static void nearCall(uint16_t to, int osz) {
+    int v = handlerAt(cpu.sr[S_CS], to, 0);
+    if (v>=0) { callModel(v, lin(S_CS, cpu.ip-3)); return; }
+    push(cpu.ip, osz); cpu.ip = to; cpu.taken++;
+}
+
+static void step() {
+    int osz = 2, seg = -1, rep = 0;
+    uint16_t ip0 = cpu.ip;
+    uint8_t op;
+    for (;;) {
+        op = (uint8_t)fetch(1);
+        if (op==0x66) osz = 4;
+        else if (op==0x26||op==0x2E||op==0x36||op==0x3E) seg = op>>3&3;
+        else if (op==0xF3||op==0xF2) rep = op;
+        else break;
+    }
+    if (!op && !mem[lin(S_CS, cpu.ip)]) { cpu.ip = ip0; emuStop = "ran into zeroed memory"; return; }
+    cpu.icount++; cpu.cycles++;
+    ModRM m; uint32_t a, b;
+    int sz = op&1 ? osz : 1;
+    if (op<0x40 && (op&7)<6) {             // ALU r/m,r  r,r/m  acc,imm
+        int f = op>>3;
+        switch (op&7) {
+        case 0: case 1: m = modrm(seg); a = alu(f, rdE(&m, sz), rdr(sz, m.reg), sz); if (f!=7) wrE(&m, sz, a); return;
+        case 2: case 3: m = modrm(seg); a = alu(f, rdr(sz, m.reg), rdE(&m, sz), sz); if (f!=7) wrr(sz, m.reg, a); return;
+        default: a = alu(f, rdr(sz, R_AX), fetch(sz), sz); if (f!=7) wrr(sz, R_AX, a); return;
         }
-        else if(!strncmp(lower,"db(",3) && line[strlen(line)-1]==')'){
-            line[strlen(line)-1]=0;
-            sprintf(line,"DB %s", line+3);
+    }
+    if (op>=0x70 && op<=0x7F) { int8_t d = (int8_t)fetch(1); if (cond(op&15)) cpu.ip += d, cpu.taken++; return; }
+    if (op>=0x40 && op<=0x4F) {
+        uint32_t cf = cpu.fl&F_CF;
+        wrr(osz, op&7, alu(op<0x48 ? 0 : 5, rdr(osz, op&7), 1, osz));
+        cpu.fl = (cpu.fl&~F_CF) | cf;
+        return;
+    }
+    if (op>=0x50 && op<=0x57) { push(op==0x54 ? cpu.r[R_SP] : rdr(osz, op&7), osz); return; }
+    if (op>=0x58 && op<=0x5F) { wrr(osz, op&7, pop(osz)); return; }
+    if (op>=0x91 && op<=0x97) { a = rdr(osz, R_AX); wrr(osz, R_AX, rdr(osz, op&7)); wrr(osz, op&7, a); return; }
+    if (op>=0xB0 && op<=0xB7) { wrr(1, op&7, fetch(1)); return; }
+    if (op>=0xB8 && op<=0xBF) { wrr(osz, op&7, fetch(osz)); return; }
+    switch (op) {
+    case 0x06: case 0x0E: case 0x16: case 0x1E: push(cpu.sr[op>>3], 2); return;
+    case 0x07: case 0x17: case 0x1F: cpu.sr[op>>3] = (uint16_t)pop(2); return;
+    case 0x0F:
+        op = (uint8_t)fetch(1);
+        if (op==0xA2) {                       // CPUID: a plain 386-class part
+            cpu.r[R_AX] = cpu.r[R_AX] ? 0 : 1; cpu.r[R_BX] = 0x756E6547; cpu.r[R_CX] = 0x6C65746E;
+            cpu.r[R_DX] = 0x49656E69; cpu.cycles += 100; return;
         }
-        else if(!strncmp(lower,"fill(",5) && line[strlen(line)-1]==')'){
-            line[strlen(line)-1]=0;
-            sprintf(line,"FILL %s", line+5);
+        if (op==0x31) { cpu.r[R_AX] = (uint32_t)cpu.cycles; cpu.r[R_DX] = (uint32_t)(cpu.cycles>>32); cpu.cycles += 20; return; }
+        if (op>=0x80 && op<=0x8F) { int16_t d = (int16_t)fetch(2); if (cond(op&15)) cpu.ip += d, cpu.taken++; return; }
+        if (op==0xAE) { fetch(1); return; }  // LFENCE and friends
+        break;
+    case 0x60: if (osz==4) { a = cpu.r[R_SP]; for (int r=0; r<8; r++) push(r==R_SP ? a : cpu.r[r], 4); }
+               else { a = cpu.r[R_SP]&0xFFFF; for (int r=0; r<8; r++) push(r==R_SP ? a : cpu.r[r]&0xFFFF, 2); }
+               return;
+    case 0x61: for (int r=8; r-->0; ) { a = pop(osz); if (r!=R_SP) wrr(osz, r, a); } return;
+    case 0x80: case 0x81: case 0x83:
+        m = modrm(seg);
+        b = op==0x83 ? (uint32_t)(int32_t)(int8_t)fetch(1) : fetch(sz);
+        a = alu(m.reg, rdE(&m, sz), b, sz);
+        if (m.reg!=7) wrE(&m, sz, a);
+        return;
+    case 0x84: case 0x85: m = modrm(seg); alu(4, rdE(&m, sz), rdr(sz, m.reg), sz); return;
+    case 0x86: case 0x87: m = modrm(seg); a = rdE(&m, sz); wrE(&m, sz, rdr(sz, m.reg)); wrr(sz, m.reg, a); return;
+    case 0x88: case 0x89: m = modrm(seg); wrE(&m, sz, rdr(sz, m.reg)); return;
+    case 0x8A: case 0x8B: m = modrm(seg); wrr(sz, m.reg, rdE(&m, sz)); return;
+    case 0x8C: m = modrm(seg); wrE(&m, 2, cpu.sr[m.reg&3]); return;
+    case 0x8D: m = modrm(seg); wrr(osz, m.reg, m.off); return;
+    case 0x8E: m = modrm(seg); cpu.sr[m.reg&3] = (uint16_t)rdE(&m, 2); return;
+    case 0x90: return;
+    case 0x98: if (osz==4) wrr(4, R_AX, (uint32_t)(int16_t)rdr(2, R_AX)); else wrr(2, R_AX, (uint32_t)(int8_t)rdr(1, R_AX)); return;
+    case 0x99: wrr(osz, R_DX, rdr(osz, R_AX)>>(8*osz-1)&1 ? 0xFFFFFFFF : 0); return;
+    case 0x9A: { uint16_t o = (uint16_t)fetch(2), s = (uint16_t)fetch(2);
+                 int v = handlerAt(s, o, 1);
+                 if (v>=0) { callModel(v, lin(S_CS, cpu.ip-5)); return; }
+                 push(cpu.sr[S_CS], 2); push(cpu.ip, 2); cpu.sr[S_CS] = s; cpu.ip = o; cpu.taken++; return; }
+    case 0x9C: push(cpu.fl|2, osz); return;
+    case 0x9D: cpu.fl = pop(osz)&0x0FD5; return;
+    case 0xA0: case 0xA1: cpu.rd++; wrr(sz, R_AX, rdm(lin(seg>=0 ? seg : S_DS, fetch(2)), sz)); return;
+    case 0xA2: case 0xA3: cpu.wr++; wrm(lin(seg>=0 ? seg : S_DS, fetch(2)), rdr(sz, R_AX), sz); return;
+    case 0xA8: case 0xA9: alu(4, rdr(sz, R_AX), fetch(sz), sz); return;
+    case 0xA4: case 0xA5: case 0xAA: case 0xAB: case 0xAC: case 0xAD: {
+        int d = cpu.fl&F_DF ? -sz : sz;
+        while (!rep || rdr(2, R_CX)) {
+            if (op<0xA6) wrm(lin(S_ES, cpu.r[R_DI]), rdm(lin(seg>=0 ? seg : S_DS, cpu.r[R_SI]), sz), sz);
+            else if (op<0xAC) wrm(lin(S_ES, cpu.r[R_DI]), rdr(sz, R_AX), sz);
+            else wrr(sz, R_AX, rdm(lin(seg>=0 ? seg : S_DS, cpu.r[R_SI]), sz));
+            cpu.rd += op<0xA6 || op>=0xAC; cpu.wr += op<0xAC;
+            if (op<0xA6 || op>=0xAC) wrr(2, R_SI, cpu.r[R_SI]+d);
+            if (op<0xAC) wrr(2, R_DI, cpu.r[R_DI]+d);
+            if (!rep) break;
+            wrr(2, R_CX, rdr(2, R_CX)-1); cpu.cycles++;
         }
-        else if(!strncmp(lower,"int(",4) && line[strlen(line)-1]==')'){
-            line[strlen(line)-1]=0;
-            sprintf(line,"INT %s", line+4);
+        return; }
+    case 0xC0: case 0xC1: m = modrm(seg); b = fetch(1); wrE(&m, sz, shift(m.reg, rdE(&m, sz), (int)b, sz)); return;
+    case 0xD0: case 0xD1: m = modrm(seg); wrE(&m, sz, shift(m.reg, rdE(&m, sz), 1, sz)); return;
+    case 0xD2: case 0xD3: m = modrm(seg); wrE(&m, sz, shift(m.reg, rdE(&m, sz), cpu.r[R_CX]&0xFF, sz)); return;
+    case 0xC3: cpu.ip = (uint16_t)pop(2); cpu.taken++; return;
+    case 0xCB: cpu.ip = (uint16_t)pop(2); cpu.sr[S_CS] = (uint16_t)pop(2); cpu.taken++; return;
+    case 0xC6: case 0xC7: m = modrm(seg); wrE(&m, sz, fetch(sz)); return;
+    case 0xCC: emuStop = "breakpoint (INT3)"; return;
+    case 0xCD: doInt((int)fetch(1)); return;
+    case 0xCF: cpu.ip = (uint16_t)pop(2); cpu.sr[S_CS] = (uint16_t)pop(2); cpu.fl = pop(2)&0x0FD5; cpu.taken++; return;
+    case 0xE2: { int8_t d = (int8_t)fetch(1); wrr(2, R_CX, rdr(2, R_CX)-1); if (rdr(2, R_CX)) cpu.ip += d, cpu.taken++; return; }
+    case 0xE3: { int8_t d = (int8_t)fetch(1); if (!rdr(2, R_CX)) cpu.ip += d, cpu.taken++; return; }
+    case 0xE8: { int16_t d = (int16_t)fetch(2); nearCall((uint16_t)(cpu.ip+d), 2); return; }
+    case 0xE9: { int16_t d = (int16_t)fetch(2); cpu.ip += d; cpu.taken++; if (cpu.ip==ip0) emuStop = "jump to self"; return; }
+    case 0xEA: { uint16_t o = (uint16_t)fetch(2); cpu.sr[S_CS] = (uint16_t)fetch(2); cpu.ip = o; cpu.taken++; return; }
+    case 0xEB: { int8_t d = (int8_t)fetch(1); cpu.ip += d; cpu.taken++; if (cpu.ip==ip0) emuStop = "jump to self"; return; }
+    case 0xF4: cpu.halt = 1; return;
+    case 0xF5: cpu.fl ^= F_CF; return;
+    case 0xF6: case 0xF7:
+        m = modrm(seg);
+        a = rdE(&m, sz);
+        switch (m.reg) {
+        case 0: case 1: alu(4, a, fetch(sz), sz); return;
+        case 2: wrE(&m, sz, ~a); return;
+        case 3: wrE(&m, sz, alu(5, 0, a, sz)); return;
+        case 4: case 5: {
+            uint64_t x = rdr(sz, R_AX), r;
+            if (m.reg==4) r = x*a;
+            else r = (uint64_t)((int64_t)(sz==1 ? (int8_t)x : sz==2 ? (int16_t)x : (int32_t)x)
+                              * (sz==1 ? (int8_t)a : sz==2 ? (int16_t)a : (int32_t)a));
+            if (sz==1) wrr(2, R_AX, (uint32_t)r);
+            else { wrr(sz, R_AX, (uint32_t)r); wrr(sz, R_DX, (uint32_t)(r>>8*sz)); }
+            return; }
+        default: {
+            uint64_t x = sz==1 ? rdr(2, R_AX) : (uint64_t)rdr(sz, R_DX)<<8*sz | rdr(sz, R_AX);
+            if (!a) { emuStop = "divide by zero"; return; }
+            if (m.reg==6) {
+                uint64_t q = x/a, r = x%a;
+                if (q>szMask(sz)) { emuStop = "divide overflow"; return; }
+                if (sz==1) wrr(2, R_AX, (uint32_t)(r<<8|q)); else { wrr(sz, R_AX, (uint32_t)q); wrr(sz, R_DX, (uint32_t)r); }
+            } else emuStop = "IDIV is not emulated";
+            return; }
         }
-        else if(!strncmp(lower,"jmp(",4) && line[strlen(line)-1]==')'){
-            line[strlen(line)-1]=0;
-            sprintf(line,"JMP %s", line+4);
+    case 0xF8: cpu.fl &= ~F_CF; return;
+    case 0xF9: cpu.fl |= F_CF; return;
+    case 0xFA: cpu.fl &= ~F_IF; return;
+    case 0xFB: cpu.fl |= F_IF; return;
+    case 0xFC: cpu.fl &= ~F_DF; return;
+    case 0xFD: cpu.fl |= F_DF; return;
+    case 0xFE: case 0xFF:
+        m = modrm(seg);
+        a = rdE(&m, sz);
+        switch (m.reg) {
+        case 0: case 1: { uint32_t cf = cpu.fl&F_CF; wrE(&m, sz, alu(m.reg ? 5 : 0, a, 1, sz)); cpu.fl = (cpu.fl&~F_CF) | cf; return; }
+        case 2: nearCall((uint16_t)a, 2); return;
+        case 4: cpu.ip = (uint16_t)a; cpu.taken++; return;
+        case 6: push(a, osz); return;
         }
-        else if(!strncmp(lower,"call(",5) && line[strlen(line)-1]==')'){
-            line[strlen(line)-1]=0;
-            sprintf(line,"CALL %s", line+5);
+        break;
+    }
+    cpu.ip = ip0;
+    emuStop = "unsupported instruction";
+}
+
+/* Fast core: each address is decoded once into a Uop and run by direct
+   threading (computed goto, GCC/Clang).  Tri's own sequences get fused
+   ops: load or store followed by head +=, and load/ALU AL,imm/store.
+   Everything else is a U_STEP op that defers to step(). */
+enum { U_NONE, U_STEP, U_NOP, U_LOAD, U_STORE, U_HEAD, U_LOADH, U_STOREH, U_RMW,
+       U_MOVI8, U_MOVI16, U_ALUAL, U_INCDEC, U_PUSH, U_POP, U_JMP, U_JCC, U_LOOP,
+       U_CALL, U_RET, U_INT, U_ALURI };
+
+static int aluAL(uint8_t op) { return op<0x40 && (op&7)==4 ? op>>3 : -1; }   // ALU AL,imm8
+
+static void decode(uint32_t a, Uop *u) {
+    const uint8_t *b = mem+a;
+    u->h = U_STEP; u->len = 0; u->n = 1;
+    if (a+8>MEMSZ || (a&0xFFFF)>0xFFF0) return;     // near a segment end: leave it to step()
+    uint8_t op = b[0];
+    int hd = b[0]==0x83 && b[1]==0xC6 ? 3 : b[0]==0x81 && b[1]==0xC6 ? 4 : 0;
+    if (op==0x8A && b[1]==0x04) {
+        int h2 = b[2]==0x83 && b[3]==0xC6 ? 3 : b[2]==0x81 && b[3]==0xC6 ? 4 : 0;
+        if (aluAL(b[2])>=0 && aluAL(b[2])!=7 && b[4]==0x88 && b[5]==0x04) {   // not CMP: it writes nothing back
+            u->h = U_RMW; u->len = 6; u->n = 3; u->r = (uint8_t)aluAL(b[2]); u->imm = b[3];
+        } else if (h2) {
+            u->h = U_LOADH; u->len = (uint8_t)(2+h2); u->n = 2;
+            u->imm = h2==3 ? (uint16_t)(int8_t)b[4] : (uint16_t)(b[4]|b[5]<<8);
+        } else { u->h = U_LOAD; u->len = 2; }
+        return;
+    }
+    if (op==0x88 && b[1]==0x04) {
+        int h2 = b[2]==0x83 && b[3]==0xC6 ? 3 : b[2]==0x81 && b[3]==0xC6 ? 4 : 0;
+        if (h2) {
+            u->h = U_STOREH; u->len = (uint8_t)(2+h2); u->n = 2;
+            u->imm = h2==3 ? (uint16_t)(int8_t)b[4] : (uint16_t)(b[4]|b[5]<<8);
+        } else { u->h = U_STORE; u->len = 2; }
+        return;
+    }
+    if ((op==0x81 || op==0x83) && b[1]>=0xC0 && !hd) {      // ALU r16,imm
+        u->h = U_ALURI; u->len = op==0x83 ? 3 : 4; u->r = b[1]&0x3F;
+        u->imm = op==0x83 ? (uint16_t)(int8_t)b[2] : (uint16_t)(b[2]|b[3]<<8);
+        return;
+    }
+    if (hd) { u->h = U_HEAD; u->len = (uint8_t)hd; u->imm = hd==3 ? (uint16_t)(int8_t)b[2] : (uint16_t)(b[2]|b[3]<<8); return; }
+    if (aluAL(op)>=0) { u->h = U_ALUAL; u->len = 2; u->r = (uint8_t)aluAL(op); u->imm = b[1]; return; }
+    if (op==0x90) { u->h = U_NOP; u->len = 1; return; }
+    if (op>=0xB0 && op<=0xB7) { u->h = U_MOVI8; u->len = 2; u->r = op&7; u->imm = b[1]; return; }
+    if (op>=0xB8 && op<=0xBF) { u->h = U_MOVI16; u->len = 3; u->r = op&7; u->imm = (uint16_t)(b[1]|b[2]<<8); return; }
+    if (op>=0x40 && op<=0x4F) { u->h = U_INCDEC; u->len = 1; u->r = op&15; return; }
+    if (op>=0x50 && op<=0x57 && op!=0x54) { u->h = U_PUSH; u->len = 1; u->r = op&7; return; }
+    if (op>=0x58 && op<=0x5F && op!=0x5C) { u->h = U_POP; u->len = 1; u->r = op&7; return; }
+    if (op==0xEB || op==0xE9) {
+        u->h = U_JMP; u->len = op==0xEB ? 2 : 3;
+        u->imm = op==0xEB ? (uint16_t)(int8_t)b[1] : (uint16_t)(b[1]|b[2]<<8);
+        return;
+    }
+    if (op>=0x70 && op<=0x7F) { u->h = U_JCC; u->len = 2; u->r = op&15; u->imm = (uint16_t)(int8_t)b[1]; return; }
+    if (op==0xE2) { u->h = U_LOOP; u->len = 2; u->imm = (uint16_t)(int8_t)b[1]; return; }
+    if (op==0xE8) { u->h = U_CALL; u->len = 3; u->imm = (uint16_t)(b[1]|b[2]<<8); return; }
+    if (op==0xC3) { u->h = U_RET; u->len = 1; return; }
+    if (op==0xCD) { u->h = U_INT; u->len = 2; u->r = b[1]; return; }
+}
+
+/* Branch-free 16-bit ADD/SUB for the hot ops; same flags as alu() */
+#define F_ARITH (F_CF|F_PF|F_AF|F_ZF|F_SF|F_OF)
+static inline uint32_t arith16(uint32_t a, uint32_t b, int sub) {
+    uint32_t r = sub ? (a&0xFFFF)-(b&0xFFFF) : (a&0xFFFF)+(b&0xFFFF), x = r&0xFFFF;
+    uint32_t ov = sub ? (a^b)&(a^r) : ~(a^b)&(a^r);
+    cpu.fl = (cpu.fl&~F_ARITH) | (r>>16&1) | (__builtin_parity(x&0xFF) ? 0 : F_PF) | ((a^b^r)&F_AF)
+           | (x ? 0 : F_ZF) | (x>>8&F_SF) | (ov>>4&F_OF);
+    return x;
+}
+
+static Uop *uopAt(uint32_t a) {
+    Uop *pg = ucache[a>>UPG];
+    if (!pg) {
+        pg = ucache[a>>UPG] = (Uop*)calloc(1<<UPG, sizeof(Uop));
+        if (!pg) die("out of memory");
+        codePg[a>>UPG] = 1;
+    }
+    Uop *u = &pg[a&((1<<UPG)-1)];
+    if (!u->h) decode(a, u);
+    return u;
+}
+
+static void runFast() {
+    static void *jt[] = { &&l_step, &&l_step, &&l_nop, &&l_load, &&l_store, &&l_head, &&l_loadh,
+        &&l_storeh, &&l_rmw, &&l_movi8, &&l_movi16, &&l_alual, &&l_incdec, &&l_push, &&l_pop,
+        &&l_jmp, &&l_jcc, &&l_loop, &&l_call, &&l_ret, &&l_int, &&l_aluri };
+    Uop *u;
+    uint32_t a, cf;
+    // only ops that can stop the run test for it
+#define NEXT do { if (cpu.icount>=emuMax) return; \
+                  u = uopAt(lin(S_CS, cpu.ip)); cpu.icount += u->n; cpu.cycles += u->n; \
+                  cpu.ip += u->len; goto *jt[u->h]; } while (0)
+#define NEXTS do { if (cpu.halt || emuStop) return; NEXT; } while (0)
+#define SIADDR lin(S_DS, cpu.r[R_SI])
+    NEXT;
+l_step:   cpu.icount--; cpu.cycles--; step(); NEXTS;          // step() counts for itself
+l_nop:    NEXT;
+l_load:   cpu.rd++; wrr(1, R_AX, mem[SIADDR]); NEXT;
+l_store:  cpu.wr++; a = SIADDR; mem[a] = (uint8_t)cpu.r[R_AX]; if (codePg[a>>UPG]) smc(a, 1); NEXT;
+l_head:   wrr(2, R_SI, arith16(cpu.r[R_SI], u->imm, 0)); NEXT;
+l_loadh:  cpu.rd++; wrr(1, R_AX, mem[SIADDR]); wrr(2, R_SI, arith16(cpu.r[R_SI], u->imm, 0)); NEXT;
+l_storeh: cpu.wr++; a = SIADDR; mem[a] = (uint8_t)cpu.r[R_AX]; if (codePg[a>>UPG]) smc(a, 1);
+          wrr(2, R_SI, arith16(cpu.r[R_SI], u->imm, 0)); NEXT;
+l_rmw:    cpu.rd++; cpu.wr++; a = SIADDR; mem[a] = (uint8_t)alu(u->r, mem[a], u->imm, 1); wrr(1, R_AX, mem[a]);
+          if (codePg[a>>UPG]) smc(a, 1);
+          NEXT;
+l_movi8:  wrr(1, u->r, u->imm); NEXT;
+l_movi16: wrr(2, u->r, u->imm); NEXT;
+l_alual:  a = alu(u->r, rdr(1, R_AX), u->imm, 1); if (u->r!=7) wrr(1, R_AX, a); NEXT;
+l_incdec: cf = cpu.fl&F_CF;
+          wrr(2, u->r&7, alu(u->r<8 ? 0 : 5, rdr(2, u->r&7), 1, 2));
+          cpu.fl = (cpu.fl&~F_CF) | cf;
+          NEXT;
+l_push:   push(rdr(2, u->r), 2); NEXT;
+l_pop:    wrr(2, u->r, pop(2)); NEXT;
+l_jmp:    if (!(uint16_t)(u->imm+u->len)) emuStop = "jump to self";
+          cpu.ip += u->imm; cpu.taken++; NEXTS;
+l_jcc:    if (cond(u->r)) cpu.ip += u->imm, cpu.taken++; NEXT;
+l_loop:   wrr(2, R_CX, rdr(2, R_CX)-1); if (rdr(2, R_CX)) cpu.ip += u->imm, cpu.taken++; NEXT;
+l_call:   nearCall((uint16_t)(cpu.ip+u->imm), 2); NEXTS;
+l_ret:    cpu.ip = (uint16_t)pop(2); cpu.taken++; NEXT;
+l_int:    doInt(u->r); NEXTS;
+l_aluri:  if ((u->r>>3)==7) { arith16(cpu.r[u->r&7], u->imm, 1); NEXT; }
+          a = (u->r>>3)==0 ? arith16(cpu.r[u->r&7], u->imm, 0) : (u->r>>3)==5 ? arith16(cpu.r[u->r&7], u->imm, 1)
+            : alu(u->r>>3, rdr(2, u->r&7), u->imm, 2);
+          wrr(2, u->r&7, a);
+          NEXT;
+#undef NEXTS
+#undef NEXT
+#undef SIADDR
+}
+
+static void emuReport(FILE *f) {
+    uint64_t busy = 0;
+    int on = 0;
+    fprintf(f,"run: %s at %04X:%04X after %llu instructions, %llu cycles\n",
+            emuStop ? emuStop : cpu.halt ? "halted" : "instruction limit",
+            cpu.sr[S_CS], cpu.ip, (unsigned long long)cpu.icount, (unsigned long long)cpu.cycles);
+    for (int v=0; v<256; v++)
+        if (hw.traps[v]) {
+            int k = intrByVec((uint8_t)v);
+            fprintf(f,"  INT 0x%02X %-12s %-11s %10llu\n", v, k>=0 ? intrTab[k].name : "-",
+                    model[v] ? model[v]->name : "-", (unsigned long long)hw.traps[v]);
         }
-        else if(!strncmp(lower,"ljmp(",5) && line[strlen(line)-1]==')'){
-            line[strlen(line)-1]=0;
-            char *p = line+5, *c = strchr(p, ',');
-            if(!c) dieSrc(i,"ljmp() needs two args");
-            *c=0;
-            sprintf(line,"LJMP %s:%s", p, c+1);
+    fprintf(f,"  pmc: %llu taken branches, %llu memory reads, %llu writes, %llu traps\n",
+            (unsigned long long)cpu.taken, (unsigned long long)cpu.rd, (unsigned long long)cpu.wr,
+            (unsigned long long)cpu.ntrap);
+    for (int e=0; e<16; e++) if (hw.engBusy[e]>busy) busy = hw.engBusy[e];
+    if (busy>cpu.cycles) fprintf(f,"  async work still running until cycle %llu\n", (unsigned long long)busy);
+    if (hw.patchOk || hw.patchBad) fprintf(f,"  patches: %u committed, %u CRC mismatch\n", hw.patchOk, hw.patchBad);
+    fprintf(f,"  fold mode %d, units on:", hw.fold);
+    for (int u=0; u<256; u++) if (hw.pw[u]) fprintf(f," %d", u), on++;
+    fprintf(f,"%s\n", on ? "" : " none");
+}
+
+/* --model vec=name: name a vector by number or intrinsic */
+static void setModel(char *arg) {
+    char *eq = strchr(arg, '=');
+    uint32_t v;
+    if (!eq) die("--model <vec|intrinsic>=<model>");
+    *eq = 0;
+    int k = findIntrName(arg);
+    if (k>=0) v = intrTab[k].vec;
+    else if (!parseNum(arg, &v) || v>0xFF) die("--model: bad vector '%s'", arg);
+    if (!strcmp(eq+1,"none")) { model[v] = NULL; return; }
+    if (!(model[v] = findModel(eq+1))) die("--model: unknown model '%s'", eq+1);
+}
+
+static void emuLoad(const char *fn) {
+    uint32_t n, e = runEntry;
+    uint8_t *img = readImage(fn, &n);
+    if (n>MEMSZ) die("%s: image larger than 1MB", fn);
+    mem = (uint8_t*)calloc(MEMSZ, 1);
+    if (!mem) die("out of memory");
+    memcpy(mem, img, n);
+    free(img);
+    memTop = n;
+    if (e==0xFFFFFFFF) {                 // boot sector if the image reaches it, else its first code byte
+        e = 0;
+        if (n>0x7C00) e = 0x7C00;
+        else while (e<n && !mem[e]) e++;
+    }
+    cpu.sr[S_CS] = (uint16_t)(e>>4&0xF000); cpu.ip = (uint16_t)e;
+    cpu.r[R_SP] = 0xFFFE; cpu.sr[S_SS] = 0x9000; cpu.fl = 0x0002;
+}
+
+static void emuExec() {
+    while (runUntil!=0xFFFFFFFF && !cpu.halt && !emuStop && cpu.icount<emuMax) {
+        if (lin(S_CS, cpu.ip)==runUntil) { emuStop = "reached --until"; return; }
+        step();
+    }
+    if (cpu.halt || emuStop) return;                     // halted before --until
+    if (runStep) while (!cpu.halt && !emuStop && cpu.icount<emuMax) step();
+    else runFast();
+}
+
+static void emuClose() {
+    for (int p=0; p<MEMSZ>>UPG; p++) { free(ucache[p]); ucache[p] = NULL; codePg[p] = 0; }
+    if (memMapped) munmap(mem, MEMSZ); else free(mem);
+    mem = NULL; memMapped = 0;
+}
+
+/* Snapshots: a header block (Cpu, Hw, image size) and then the whole
+   address space at SNAP_HDR, so a restore maps the file MAP_PRIVATE and
+   pages stay shared with the snapshot until the run writes them. */
+#define SNAP_HDR 0x10000     // multiple of any page size mmap wants
+typedef struct { char magic[8]; uint32_t top; Cpu cpu; Hw hw; } SnapHdr;
+
+static void snapSave(FILE *f, const char *fn) {
+    static char pad[SNAP_HDR];
+    SnapHdr h;
+    memset(&h, 0, sizeof h);
+    memcpy(h.magic, "TRISNAP1", 8); h.top = memTop; h.cpu = cpu; h.hw = hw;
+    h.cpu.halt = 0;
+    if (fwrite(&h, sizeof h, 1, f)!=1 || fwrite(pad, SNAP_HDR-sizeof h, 1, f)!=1
+        || fwrite(mem, MEMSZ, 1, f)!=1 || fflush(f)) die("cannot write snapshot '%s'", fn);
+}
+
+static void snapOpen(int fd, const char *fn) {
+    SnapHdr h;
+    if (pread(fd, &h, sizeof h, 0)!=(ssize_t)sizeof h || memcmp(h.magic, "TRISNAP1", 8))
+        die("%s: not a Tri snapshot", fn);
+    cpu = h.cpu; hw = h.hw; memTop = h.top;
+    mem = (uint8_t*)mmap(NULL, MEMSZ, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, SNAP_HDR);
+    if (mem==MAP_FAILED) die("%s: cannot map snapshot", fn);
+    memMapped = 1;
+}
+
+static void runStart(const char *fn, int restore) {
+    emuMax = runMax;
+    if (restore) {
+        FILE *f = fopen(fn,"rb");
+        if (!f) die("cannot open snapshot '%s'", fn);
+        snapOpen(fileno(f), fn);
+        fclose(f);                    // the mapping keeps the pages
+        emuMax += cpu.icount;
+    } else emuLoad(fn);
+}
+
+/* --check: run the image again on the reference interpreter and compare
+   the machine state the op cache left with it */
+static void runCheckStep(const char *fn, int restore) {
+    static char tty[LNSZ*4];
+    Cpu c = cpu;
+    const char *st = emuStop;
+    uint8_t *m = (uint8_t*)malloc(MEMSZ);
+    int bad = 0;
+    if (!m) die("out of memory");
+    memcpy(m, mem, MEMSZ);
+    emuClose();
+    memset(&cpu, 0, sizeof cpu); memset(&hw, 0, sizeof hw); emuStop = NULL;
+    runStep = 1; ttyBuf = tty; ttyN = 0;        // the tty already printed once
+    runStart(fn, restore);
+    emuExec();
+    runStep = 0; ttyBuf = NULL;
+    for (int k=0; k<8; k++)
+        if (c.r[k]!=cpu.r[k]) bad++, fprintf(stderr,"check: reg %d: %08X, --step %08X\n", k, c.r[k], cpu.r[k]);
+    for (int k=0; k<4; k++)
+        if (c.sr[k]!=cpu.sr[k]) bad++, fprintf(stderr,"check: sreg %d: %04X, --step %04X\n", k, c.sr[k], cpu.sr[k]);
+    if (c.ip!=cpu.ip || c.fl!=cpu.fl || c.halt!=cpu.halt || (st==NULL)!=(emuStop==NULL) || (st && strcmp(st, emuStop)))
+        bad++, fprintf(stderr,"check: IP %04X flags %04X %s, --step IP %04X flags %04X %s\n", c.ip, c.fl,
+                       st ? st : c.halt ? "halted" : "limit", cpu.ip, cpu.fl, emuStop ? emuStop : cpu.halt ? "halted" : "limit");
+    if (c.icount!=cpu.icount || c.cycles!=cpu.cycles)
+        bad++, fprintf(stderr,"check: %llu instructions %llu cycles, --step %llu and %llu\n",
+                       (unsigned long long)c.icount, (unsigned long long)c.cycles,
+                       (unsigned long long)cpu.icount, (unsigned long long)cpu.cycles);
+    for (uint32_t a=0; a<MEMSZ; a++)
+        if (m[a]!=mem[a]) {
+            if (bad++<16) fprintf(stderr,"check: [%05X] = %02X, --step %02X\n", a, m[a], mem[a]);
         }
+    free(m);
+    if (bad) die("check: op cache and --step differ (%d)", bad);
+    fprintf(stderr,"check: op cache and --step agree\n");
+}
 
-        // Borrow & scopes
-        if(!strcmp(line,"{")) {
-            if(sp+1>=MAXS) dieSrc(i,"scope overflow");
-            sp++; bstack[sp].bm=bstack[sp].bi=0;
-            continue;
+static void runImage(const char *fn, const char *dump, const char *save, int restore) {
+    runStart(fn, restore);
+    emuExec();
+    emuReport(stderr);
+    if (dump) {
+        FILE *f = fopen(dump,"wb");
+        if (!f || fwrite(mem, 1, 0x10000, f)!=0x10000) die("cannot write '%s'", dump);
+        fclose(f);
+    }
+    if (save) {
+        FILE *f = fopen(save,"wb");
+        if (!f) die("cannot create snapshot '%s'", save);
+        snapSave(f, save);
+        fclose(f);
+    }
+    if (runCheck && !runStep) runCheckStep(fn, restore);
+    emuClose();
+}
+
+/* Batch runs: every job restores the same snapshot, applies its own
+   settings and runs to a stop.  Workers own a range of job indices,
+   take from its low end and, when empty, steal the upper half of the
+   fullest other range.  Results land in job order, so the report does
+   not depend on the schedule or the thread count. */
+typedef struct {
+    char name[LNSZ], dump[LNSZ];
+    uint32_t lat[NINTR], npoke, poke[16][2];
+    uint64_t max;
+    const char *stop;
+    uint64_t icount, cycles, traps;
+    uint32_t crc;
+    char tty[LNSZ*4];
+} Job;
+typedef struct { pthread_mutex_t mu; int lo, hi; } Range;
+
+static Job   *jobs;
+static int    njob, nwork, snapFd;
+static Range *ranges;
+
+static void runJob(Job *j) {
+    snapOpen(snapFd, "snapshot");
+    memcpy(jobLat, j->lat, sizeof jobLat);
+    for (uint32_t k=0; k<j->npoke; k++) mem[j->poke[k][0]] = (uint8_t)j->poke[k][1];
+    emuStop = NULL; ttyBuf = j->tty; ttyN = 0;
+    emuMax = cpu.icount + (j->max ? j->max : runMax);
+    emuExec();
+    j->stop = emuStop ? emuStop : cpu.halt ? "halted" : "instruction limit";
+    j->icount = cpu.icount; j->cycles = cpu.cycles; j->crc = crc32(mem, 0x10000);
+    for (int v=0; v<256; v++) j->traps += hw.traps[v];
+    if (*j->dump) {
+        FILE *f = fopen(j->dump,"wb");
+        if (!f || fwrite(mem, 1, 0x10000, f)!=0x10000) die("cannot write '%s'", j->dump);
+        fclose(f);
+    }
+    ttyBuf = NULL;
+    emuClose();
+}
+
+static int takeJob(int w) {
+    Range *r = &ranges[w];
+    pthread_mutex_lock(&r->mu);
+    int k = r->lo<r->hi ? r->lo++ : -1;
+    pthread_mutex_unlock(&r->mu);
+    return k;
+}
+
+static int stealJobs(int w) {
+    for (int d=1; d<nwork; d++) {
+        Range *v = &ranges[(w+d)%nwork], *r = &ranges[w];
+        pthread_mutex_lock(&v->mu);
+        int n = (v->hi-v->lo+1)/2, hi = v->hi;
+        if (n) v->hi -= n;
+        pthread_mutex_unlock(&v->mu);
+        if (!n) continue;
+        pthread_mutex_lock(&r->mu);
+        r->lo = hi-n; r->hi = hi;
+        pthread_mutex_unlock(&r->mu);
+        return 1;
+    }
+    return 0;
+}
+
+static void *worker(void *arg) {
+    int w = (int)(intptr_t)arg;
+    for (;;) {
+        int k = takeJob(w);
+        if (k>=0) runJob(&jobs[k]);
+        else if (!stealJobs(w)) return NULL;
+    }
+}
+
+/* Job file: one job per line, "name [--lat i=c]... [--poke addr=byte]...
+   [--max n] [--dump file]"; ';' starts a comment */
+static void loadJobs(const char *fn) {
+    FILE *f = fopen(fn,"r");
+    char buf[LNSZ*4];
+    int ln = 0, cap = 0;
+    if (!f) die("cannot open job file '%s'", fn);
+    while (fgets(buf, sizeof buf, f)) {
+        char *save, *t = strtok_r(buf," \t\r\n",&save), *eq;
+        uint32_t a, b;
+        ln++;
+        if (!t || *t==';') continue;
+        if (njob==cap && !(jobs = (Job*)realloc(jobs, sizeof(Job)*(cap = cap ? 2*cap : 64)))) die("out of memory");
+        Job *j = &jobs[njob++];
+        memset(j, 0, sizeof *j);
+        snprintf(j->name, LNSZ, "%s", t);
+        while ((t = strtok_r(NULL," \t\r\n",&save)) && *t!=';') {
+            char *v = strtok_r(NULL," \t\r\n",&save);
+            if (!v) die("%s:%d: '%s' needs a value", fn, ln, t);
+            eq = strchr(v,'=');
+            if (!strcmp(t,"--max")) j->max = strtoull(v, NULL, 0);
+            else if (!strcmp(t,"--dump")) snprintf(j->dump, LNSZ, "%s", v);
+            else if (!strcmp(t,"--lat") && eq) {
+                *eq = 0;
+                int k = findIntrName(v);
+                if (k<0 || !parseNum(eq+1, &j->lat[k])) die("%s:%d: --lat <intrinsic>=<cycles>", fn, ln);
+            }
+            else if (!strcmp(t,"--poke") && eq) {
+                *eq = 0;
+                if (!parseNum(v, &a) || !parseNum(eq+1, &b) || a>=MEMSZ || b>0xFF || j->npoke==16)
+                    die("%s:%d: --poke <addr>=<byte>, at most 16", fn, ln);
+                j->poke[j->npoke][0] = a; j->poke[j->npoke++][1] = b;
+            }
+            else die("%s:%d: unknown job option '%s'", fn, ln, t);
         }
-        if(!strcmp(line,"}")) {
-            if(sp==0) dieSrc(i,"unmatched scope close");
-            sp--; continue;
+    }
+    fclose(f);
+    if (!njob) die("%s: no jobs", fn);
+}
+
+static void runBatch(const char *fn, int restore, const char *jobfn, int nthr) {
+    FILE *snap = tmpfile();
+    if (!snap) die("cannot create snapshot file");
+    loadJobs(jobfn);
+    emuMax = runMax;
+    if (restore) {
+        FILE *f = fopen(fn,"rb");
+        if (!f) die("cannot open snapshot '%s'", fn);
+        snapOpen(fileno(f), fn);
+        fclose(f);
+    } else {
+        // boot once: to --until, or not at all
+        emuLoad(fn);
+        if (runUntil!=0xFFFFFFFF) {
+            emuExec();
+            if (emuStop && strcmp(emuStop,"reached --until")) die("boot: %s", emuStop);
+            if (cpu.halt) die("boot: halted before --until");
+            if (!emuStop) die("boot: instruction limit before --until");
         }
-        if(!strncmp(line,"let &mut",8)) {
-            if(bstack[sp].bm||bstack[sp].bi) dieSrc(i,"borrow error");
-            bstack[sp].bm=1; continue;
+    }
+    emuStop = NULL;
+    snapSave(snap, "snapshot");
+    emuClose();
+    snapFd = fileno(snap);
+    runUntil = 0xFFFFFFFF;
+    crc32(NULL, 0);                  // fill the tables before workers share them
+    nwork = nthr<1 ? 1 : nthr>njob ? njob : nthr;
+    ranges = (Range*)calloc(nwork, sizeof(Range));
+    pthread_t *th = (pthread_t*)malloc(sizeof(pthread_t)*nwork);
+    if (!ranges || !th) die("out of memory");
+    for (int w=0; w<nwork; w++) {
+        pthread_mutex_init(&ranges[w].mu, NULL);
+        ranges[w].lo = (int)((int64_t)njob*w/nwork); ranges[w].hi = (int)((int64_t)njob*(w+1)/nwork);
+    }
+    for (int w=1; w<nwork; w++)
+        if (pthread_create(&th[w], NULL, worker, (void*)(intptr_t)w)) die("cannot start worker thread");
+    worker((void*)0);
+    for (int w=1; w<nwork; w++) pthread_join(th[w], NULL);
+    uint64_t lo = ~0ull, hi = 0, sum = 0, ins = 0;
+    for (int k=0; k<njob; k++) {
+        const Job *j = &jobs[k];
+        printf("%-16s %-22s %12llu instr %14llu cycles %8llu traps  mem %08X\n", j->name, j->stop,
+               (unsigned long long)j->icount, (unsigned long long)j->cycles, (unsigned long long)j->traps, j->crc);
+        if (*j->tty) printf("%-16s tty: %s\n", "", j->tty);
+        if (j->cycles<lo) lo = j->cycles;
+        if (j->cycles>hi) hi = j->cycles;
+        sum += j->cycles; ins += j->icount;
+    }
+    printf("batch: %d jobs, %llu instructions; cycles min %llu, mean %llu, max %llu\n", njob,
+           (unsigned long long)ins, (unsigned long long)lo, (unsigned long long)(sum/njob), (unsigned long long)hi);
+    fprintf(stderr,"batch: %d worker thread(s)\n", nwork);
+    fclose(snap); free(th); free(ranges); free(jobs);
+}
+
+/* Source → image: everything after read_src */
+static void build() {
+    pass1();
+    if(instrMode) instrument("out.map");
+    schedule();
+    lowerStreams();
+    if(largeTape) lowerLargeTape();
+    if(peepOn) peephole();
+    optGates();
+    if(gateThresh){ autoGate(); dropRedundant(); }
+    if(dispMode&DISP_BATCH) lowerBatch();
+    if(dispMode&DISP_FAR) lowerFar();
+    if(nbulk) lowerBulk();
+    asm_passA();
+    asm_passB();
+}
+
+/* Tuning: each variant is compiled and run in a forked child with its
+   tunables pinned, so a variant that fails to build or run costs only
+   its own point.  Results come back over a pipe and are memoized. */
+#define TUNE_GRID 4096       // largest grid searched exhaustively
+typedef struct { int ok; uint64_t cost; char stop[32]; } TuneRes;
+typedef struct { uint32_t v[MAXSYM]; TuneRes r; } TunePt;
+
+static int     tun[MAXSYM], ntun, tuneIns;
+static TunePt *tpt;
+static int     ntpt, captpt;
+
+static TunePt *tuneFind(const uint32_t *v) {
+    for (int k=0; k<ntpt; k++) if (!memcmp(tpt[k].v, v, ntun*sizeof *v)) return &tpt[k];
+    return NULL;
+}
+
+static void tuneChild(const uint32_t *v, int fd) {
+    TuneRes r;
+    char bin[64];
+    memset(&r, 0, sizeof r);
+    for (int k=0; k<nsym; k++) sym[k].decl = 0;
+    for (int k=0; k<ntun; k++) { sym[tun[k]].v = v[k]; sym[tun[k]].set = 1; }
+    if (!freopen("/dev/null","w",stdout) || !freopen("/dev/null","w",stderr)) _exit(1);
+    snprintf(bin, sizeof bin, "/tmp/tri-tune-%d.bin", (int)getpid());
+    outBin = bin;
+    build();
+    emuMax = runMax;
+    emuLoad(bin);
+    unlink(bin);
+    emuExec();
+    const char *st = cpu.halt ? "halted" : emuStop ? emuStop : "--max reached";
+    r.ok = cpu.halt || (emuStop && (!strcmp(st,"jump to self") || !strcmp(st,"reached --until")
+                                    || !strcmp(st,"ran into zeroed memory")));
+    r.cost = cpu.cycles;
+    for (int e=0; e<16; e++) if (hw.engBusy[e]>r.cost) r.cost = hw.engBusy[e];   // done when the engines drain
+    if (tuneIns) r.cost = cpu.icount;
+    snprintf(r.stop, sizeof r.stop, "%s", st);
+    if (write(fd, &r, sizeof r)!=(ssize_t)sizeof r) _exit(1);
+    _exit(0);
+}
+
+/* Evaluate n points, at most nthr children at a time; cached points are free */
+static void tuneEval(const uint32_t *pts, int n, int nthr) {
+    pid_t *pid = (pid_t*)calloc(nthr, sizeof *pid);
+    int *fd = (int*)malloc(nthr*sizeof *fd), *slot = (int*)malloc(nthr*sizeof *slot), live = 0;
+    if (!pid || !fd || !slot) die("out of memory");
+    for (int i=0; i<n || live; ) {
+        if (i<n && live<nthr) {
+            const uint32_t *v = pts + (size_t)i++*ntun;
+            if (tuneFind(v)) continue;
+            if (ntpt==captpt) {
+                captpt = captpt ? captpt*2 : 64;
+                if (!(tpt = (TunePt*)realloc(tpt, captpt*sizeof *tpt))) die("out of memory");
+            }
+            TunePt *t = &tpt[ntpt];
+            memset(t, 0, sizeof *t);
+            memcpy(t->v, v, ntun*sizeof *v);
+            snprintf(t->r.stop, sizeof t->r.stop, "build or run failed");
+            int p[2], w = 0;
+            while (pid[w]) w++;
+            if (pipe(p)) die("tune: cannot create pipe");
+            fflush(stdout); fflush(stderr);
+            if ((pid[w] = fork())<0) die("tune: cannot fork");
+            if (!pid[w]) { close(p[0]); tuneChild(v, p[1]); }
+            close(p[1]);
+            fd[w] = p[0]; slot[w] = ntpt++; live++;
+            continue;
         }
-        if(!strncmp(line,"let &",5)) {
-            if(bstack[sp].bm) dieSrc(i,"borrow error");
-            bstack[sp].bi=1; continue;
+        int stat; pid_t d = wait(&stat);
+        if (d<0) die("tune: lost a child");
+        for (int w=0; w<nthr; w++) if (pid[w]==d) {
+            TuneRes r;
+            if (read(fd[w], &r, sizeof r)==(ssize_t)sizeof r) tpt[slot[w]].r = r;
+            close(fd[w]); pid[w] = 0; live--;
         }
+    }
+    free(pid); free(fd); free(slot);
+}
 
-        // Built‐ins
-        if(!strcmp(line,"tape_start()")) {
-            if(al+2>=MAXL) dieSrc(i,"asm1 overflow");
-            asmSrcLine[al]=i; strcpy(asm1[al++],"ORG 0x500");
-            asmSrcLine[al]=i; strcpy(asm1[al++],"DB 0xBE,0x00,0x05");
-            continue;
+static int tuneBetter(const TuneRes *a, const TuneRes *b) {
+    return a->ok && (!b->ok || a->cost<b->cost);
+}
+
+static void tunePrint(FILE *f, const uint32_t *v) {
+    for (int k=0; k<ntun; k++) fprintf(f, "%s%s=%u", k ? " " : "", sym[tun[k]].name, v[k]);
+}
+
+/* Copy the source, turning each tunable into a const: searched ones at
+   their best value, --set ones at the pinned value */
+static void tuneWrite(const char *fn, const char *ofn, const uint32_t *best) {
+    FILE *f = fopen(fn,"r"), *o = fopen(ofn,"w");
+    char buf[LNSZ], lower[LNSZ], nm[16];
+    if (!f) die("cannot open source '%s'", fn);
+    if (!o) die("cannot create '%s'", ofn);
+    while (fgets(buf, LNSZ, f)) {
+        char *t = buf; int k, j;
+        while (*t==' ' || *t=='\t') t++;
+        for (j=0; t[j] && j<LNSZ-1; j++) lower[j] = tolower((unsigned char)t[j]);
+        lower[j] = 0;
+        const Sym *s = !strncmp(lower,"tunable ",8) && sscanf(t+8," %15[A-Za-z0-9_]", nm)==1 ? findSym(nm) : NULL;
+        if (!s) { fputs(buf, o); continue; }
+        for (k=0; k<ntun && tun[k]!=s-sym; k++) ;
+        fprintf(o, "%.*s; tuned: %s", (int)(t-buf), buf, t);
+        if (buf[strlen(buf)-1]!='\n') fputc('\n', o);
+        fprintf(o, "%.*sconst %s = %u\n", (int)(t-buf), buf, nm, k<ntun ? best[k] : s->v);
+    }
+    fclose(f);
+    if (fclose(o)) die("cannot write '%s'", ofn);
+}
+
+static void tune(const char *fn, const char *ofn, int hill, int nthr) {
+    if (nthr<1) nthr = 1;
+    for (int i=0; i<sl; i++) {
+        char line[LNSZ], lower[LNSZ]; int j;
+        strcpy(line, src[i]);
+        for (j=0; line[j]; j++) lower[j] = tolower((unsigned char)line[j]);
+        lower[j] = 0;
+        parseDecl(i, line, lower);
+    }
+    for (int k=0; k<nsym; k++) {
+        if (sym[k].set && !sym[k].decl) die("--set %s: no tunable of that name", sym[k].name);
+        if (sym[k].tun && !sym[k].set) tun[ntun++] = k;
+    }
+    if (!ntun) die("%s: no tunable to search", fn);
+    uint32_t best[MAXSYM], *pts;
+    int bi = -1;   // an index: tuneEval() may move tpt
+    if (!hill) {
+        uint64_t total = 1;
+        for (int k=0; k<ntun; k++) {
+            total *= (sym[tun[k]].hi-sym[tun[k]].lo)/sym[tun[k]].step+1;
+            if (total>TUNE_GRID) die("tune: grid has more than %d points; use --hill", TUNE_GRID);
         }
-        if(!strcmp(line,"load()")) {
-            if(al+1>=MAXL) dieSrc(i,"asm1 overflow");
-            asmSrcLine[al]=i; strcpy(asm1[al++],"DB 0x8A,0x04");
-            continue;
+        if (!(pts = (uint32_t*)malloc(total*(unsigned)ntun*sizeof *pts))) die("out of memory");
+        for (int k=0; k<ntun; k++) best[k] = sym[tun[k]].lo;
+        for (uint64_t n=0; n<total; n++) {           // odometer, last tunable fastest
+            memcpy(pts + n*ntun, best, ntun*sizeof *best);
+            for (int k=ntun-1; k>=0; k--) {
+                const Sym *s = &sym[tun[k]];
+                if ((best[k] += s->step)<=s->hi) break;
+                best[k] = s->lo;
+            }
         }
-        if(!strcmp(line,"store()")) {
-            if(al+1>=MAXL) dieSrc(i,"asm1 overflow");
-            asmSrcLine[al]=i; strcpy(asm1[al++],"DB 0x88,0x04");
-            continue;
+        tuneEval(pts, (int)total, nthr);
+        for (int k=0; k<ntpt; k++) if (bi<0 || tuneBetter(&tpt[k].r, &tpt[bi].r)) bi = k;
+    } else {
+        if (!(pts = (uint32_t*)malloc((size_t)2*ntun*ntun*sizeof *pts))) die("out of memory");
+        for (int k=0; k<ntun; k++) {                  // start mid-range
+            const Sym *s = &sym[tun[k]];
+            best[k] = s->lo + (s->hi-s->lo)/s->step/2*s->step;
         }
-        if(!strncmp(line,"head +=",7)) {
-            char *numstr=line+7; char *end;
-            long v=strtol(numstr,&end,0);
-            if(end==numstr||v<0||v>255) dieSrc(i,"head offset 0..255");
-            char tmp[LNSZ];
-            int n=sprintf(tmp,"DB 0x83,0xC6,%ld",v);
-            if(n<0||n>=LNSZ) dieSrc(i,"sprintf overflow");
-            if(al+1>=MAXL) dieSrc(i,"asm1 overflow");
-            asmSrcLine[al]=i; strcpy(asm1[al++],tmp);
-            continue;
+        tuneEval(best, 1, 1);
+        for (bi = (int)(tuneFind(best)-tpt);;) {
+            int n = 0;
+            for (int k=0; k<ntun; k++) {
+                const Sym *s = &sym[tun[k]];
+                for (int d=-1; d<=1; d+=2) {
+                    if (d<0 ? best[k]<s->lo+s->step : best[k]+s->step>s->hi) continue;
+                    memcpy(pts + n*ntun, best, ntun*sizeof *best);
+                    pts[n*ntun+k] += d*(int)s->step;
+                    n++;
+                }
+            }
+            tuneEval(pts, n, nthr);
+            int nb = bi;
+            for (int k=0; k<n; k++) {
+                int t = (int)(tuneFind(pts + k*ntun)-tpt);
+                if (tuneBetter(&tpt[t].r, &tpt[nb].r)) nb = t;
+            }
+            if (nb==bi) break;
+            bi = nb;
+            memcpy(best, tpt[bi].v, ntun*sizeof *best);
+        }
+    }
+    free(pts);
+    if (!tpt[bi].r.ok) die("tune: no variant ran to completion (%s)", tpt[bi].r.stop);
+    memcpy(best, tpt[bi].v, ntun*sizeof *best);
+    // report the five cheapest variants
+    int shown[5], ns = 0;
+    for (; ns<5; ns++) {
+        int m = -1;
+        for (int k=0; k<ntpt; k++) {
+            int seen = 0;
+            for (int q=0; q<ns; q++) seen |= shown[q]==k;
+            if (!seen && tpt[k].r.ok && (m<0 || tpt[k].r.cost<tpt[m].r.cost)) m = k;
         }
+        if (m<0) break;
+        shown[ns] = m;
+        printf("%12llu %s  ", (unsigned long long)tpt[m].r.cost, tuneIns ? "instr " : "cycles");
+        tunePrint(stdout, tpt[m].v);
+        printf("  (%s)\n", tpt[m].r.stop);
+    }
+    int bad = 0;
+    for (int k=0; k<ntpt; k++) bad += !tpt[k].r.ok;
+    printf("tune: %s search, %d variant(s) evaluated, %d failed; best ", hill ? "hill-climbing" : "grid", ntpt, bad);
+    tunePrint(stdout, best);
+    printf(" -> %s\n", ofn);
+    tuneWrite(fn, ofn, best);
+    free(tpt);
+}
 
-        // Fallback to copy
-        if(al>=MAXL) dieSrc(i,"asm1 overflow");
-        asmSrcLine[al]=i;
-        strcpy(asm1[al++], line);
+/* Superoptimizer: for every sequence of up to PEEP_LEN load, store and
+   head += 1 ops it looks for the cheapest equivalent among short
+   sequences of MOV AL,[SI+d], MOV [SI+d],AL, INC/DEC SI, ADD SI,k and
+   LEA SI,[SI+d].  Sequences are
+   matched on a symbolic state: SI and the tape cells as offsets from the
+   entry SI, AL as the entry AL or an entry cell, and for CF and the other
+   flags the instruction that last set them.  A rule is kept when no
+   split into shorter rules does as well, and is replayed on the emulator
+   from random and edge-case states before it is printed.  The output
+   replaces the peepTab initializer. */
+#define SO_BIG  3            // candidates this long over every offset
+#define SO_SMALL 4           // and this long over offsets within +-4
+#define SO_RAND 256          // emulator states per rule
+#define SO_AL0  0x7F         // AL on entry; other values are entry cells
+#define SO_NSEQ 1092         // 3 + 9 + ... + 3^PEEP_LEN
+enum { SO_L, SO_S, SO_LD, SO_SD, SO_ADD, SO_INC, SO_DEC, SO_LEA };
+typedef struct { uint8_t op; int8_t d; } SoIns;
+typedef struct {
+    int8_t si, al, nw, wo[8], wv[8];     // writes sorted by offset, identities dropped
+    int32_t cf, fl;                      // 0 entry, else kind<<16 | pre-SI<<8 | imm
+} SoSt;
+typedef struct { uint8_t key[32]; int used, n; uint32_t cost; SoIns seq[SO_SMALL]; } SoEnt;
+
+#define SO_HASH (1<<18)
+static SoEnt *soTab;
+
+static void soExec(SoSt *s, SoIns x) {
+    int o = s->si + (x.op==SO_LD || x.op==SO_SD ? x.d : 0), k;
+    switch (x.op) {
+    case SO_L: case SO_LD:
+        for (k=0; k<s->nw && s->wo[k]!=o; k++) ;
+        s->al = (int8_t)(k<s->nw ? s->wv[k] : o);
+        break;
+    case SO_S: case SO_SD:
+        for (k=0; k<s->nw && s->wo[k]<o; k++) ;
+        if (k<s->nw && s->wo[k]==o) {
+            if (s->al!=o) { s->wv[k] = s->al; break; }
+            memmove(s->wo+k, s->wo+k+1, s->nw-k-1); memmove(s->wv+k, s->wv+k+1, s->nw-k-1); s->nw--;
+        } else if (s->al!=o) {
+            memmove(s->wo+k+1, s->wo+k, s->nw-k); memmove(s->wv+k+1, s->wv+k, s->nw-k); s->nw++;
+            s->wo[k] = (int8_t)o; s->wv[k] = s->al;
+        }
+        break;
+    case SO_ADD: s->cf = s->fl = 1<<16 | (uint8_t)s->si<<8 | (uint8_t)x.d; s->si += x.d; break;
+    case SO_INC: s->fl = 1<<16 | (uint8_t)s->si<<8 | 1; s->si++; break;
+    case SO_DEC: s->fl = 2<<16 | (uint8_t)s->si<<8 | 1; s->si--; break;
+    case SO_LEA: s->si += x.d; break;
+    }
+}
+
+static int soBytes(const SoIns *q, int n, uint8_t *b) {
+    int m = 0;
+    for (int i=0; i<n; i++) switch (q[i].op) {
+    case SO_L:   b[m++] = 0x8A; b[m++] = 0x04; break;
+    case SO_S:   b[m++] = 0x88; b[m++] = 0x04; break;
+    case SO_LD:  b[m++] = 0x8A; b[m++] = 0x44; b[m++] = (uint8_t)q[i].d; break;
+    case SO_SD:  b[m++] = 0x88; b[m++] = 0x44; b[m++] = (uint8_t)q[i].d; break;
+    case SO_ADD: b[m++] = 0x83; b[m++] = 0xC6; b[m++] = (uint8_t)q[i].d; break;
+    case SO_INC: b[m++] = 0x46; break;
+    case SO_DEC: b[m++] = 0x4E; break;
+    case SO_LEA: b[m++] = 0x8D; b[m++] = 0x74; b[m++] = (uint8_t)q[i].d; break;
     }
+    return m;
+}
 
-    if(sp!=0) dieSrc(sl-1,"unclosed scope(s)");
+/* Entry for the state, ignoring flags when dead; insert adds it if new */
+static SoEnt *soFind(const SoSt *s, int dead, int insert) {
+    uint8_t k[32];
+    uint32_t h = 2166136261u;
+    memset(k, 0, sizeof k);
+    k[0] = (uint8_t)dead; k[1] = (uint8_t)s->si; k[2] = (uint8_t)s->al; k[3] = (uint8_t)s->nw;
+    memcpy(k+4, s->wo, s->nw); memcpy(k+12, s->wv, s->nw);
+    if (!dead) { memcpy(k+20, &s->cf, 4); memcpy(k+24, &s->fl, 4); }
+    for (int i=0; i<32; i++) h = (h^k[i])*16777619u;
+    for (h &= SO_HASH-1; soTab[h].used; h = (h+1)&(SO_HASH-1))
+        if (!memcmp(soTab[h].key, k, 32)) return &soTab[h];
+    if (!insert) return NULL;
+    memcpy(soTab[h].key, k, 32); soTab[h].used = 1; soTab[h].cost = 0xFFFFFFFF;
+    return &soTab[h];
 }
 
-/* PASS A: copy asm1 → lines2 and record labels */
-static void asm_passA() {
-    for(int i=0;i<al;i++){
-        if(ln2>=MAXL) dieAsm(i,"lines2 overflow");
-        lines2[ln2] = (char*)malloc(LNSZ);
-        if(!lines2[ln2]) dieAsm(i,"out of memory");
-        strcpy(lines2[ln2], asm1[i]);
-        lines2AsmIdx[ln2] = i;
-        ln2++;
+static long soCand;
+static void soSearch(SoIns *q, int n, const SoSt *s, int max, int span, uint32_t bytes) {
+    static const uint8_t len[] = { 2, 2, 3, 3, 3, 1, 1, 3 };
+    for (int dead=0; dead<2; dead++) {
+        SoEnt *e = soFind(s, dead, 0);
+        uint32_t c = bytes*16+n;
+        if (e && c<e->cost) { e->cost = c; e->n = n; memcpy(e->seq, q, n*sizeof *q); }
     }
-    uint32_t pc=0;
-    for(int i=0;i<ln2;i++){
-        char tmp[LNSZ]; strcpy(tmp, trim(lines2[i]));
-        char *save, *tok = strtok_r(tmp," \t,",&save);
-        if(!tok) continue;
-        if(tok[strlen(tok)-1]==':'){
-            tok[strlen(tok)-1]=0;
-            recordLabel(tok, pc, i);
-        } else {
-            pc += line_sz(lines2[i]);
+    soCand++;
+    if (n==max) return;
+    for (int op=SO_L; op<=SO_LEA; op++)
+        for (int d=-span; d<=span; d++) {
+            if ((op==SO_L || op==SO_S || op==SO_INC || op==SO_DEC) ? d : op!=SO_ADD && !d) continue;
+            SoSt t = *s;
+            q[n].op = (uint8_t)op; q[n].d = (int8_t)d;
+            soExec(&t, q[n]);
+            if (t.si<-48 || t.si>48) continue;
+            soSearch(q, n+1, &t, max, span, bytes+len[op]);
         }
-    }
 }
 
-/* Byte-emit helpers */
-static void e8(uint8_t b){ fputc(b,out); }
-static void e16(uint16_t w){ e8(w&0xFF); e8(w>>8); }
-static void e32(uint32_t w){ e16(w&0xFFFF); e16(w>>16); }
+/* Replay both encodings on the emulator from the same state; 0 if they differ */
+static int soReplay(const uint8_t *a, int na, const uint8_t *b, int nb, int dead, uint32_t *rng) {
+    static const uint16_t edge[] = { 0, 1, 0xFFFF, 0xFFFE, 0xFFFC, 0x7FFF, 0x7FFE, 0x7FFC, 0x8000, 0x000F, 0x00FF };
+    uint32_t mask = ~(dead ? F_CF|F_PF|F_AF|F_ZF|F_SF|F_OF : 0u);
+    for (int t=0; t<SO_RAND; t++) {
+        Cpu c0, c1; uint8_t cell[128], res[128];
+        memset(&c0, 0, sizeof c0);
+        for (int r=0; r<8; r++) c0.r[r] = (*rng = *rng*1103515245u+12345u)>>8&0xFFFF;
+        if (t<(int)(sizeof edge/sizeof edge[0])) c0.r[R_SI] = edge[t];
+        c0.sr[S_DS] = (uint16_t)(c0.r[R_DX]%0xE000); c0.sr[S_CS] = 0xFFFF; c0.ip = 0x10;    // code at 1MB, clear of any DS:SI
+        c0.fl = 0x0002 | (c0.r[R_DI]&(F_CF|F_PF|F_AF|F_ZF|F_SF|F_OF|F_DF));
+        for (int i=0; i<128; i++) cell[i] = (uint8_t)((*rng = *rng*1103515245u+12345u)>>16);
+        for (int run=0; run<2; run++) {
+            const uint8_t *code = run ? b : a; int n = run ? nb : na;
+            cpu = c0; emuStop = NULL;
+            for (int i=0; i<128; i++) mem[lin(S_DS, c0.r[R_SI]+i-64)] = cell[i];
+            memcpy(mem+0x100000, code, n);
+            for (int g=0; g<16 && cpu.ip!=0x10+n && !emuStop; g++) step();
+            if (emuStop || cpu.ip!=0x10+n) return 0;
+            cpu.icount = cpu.cycles = cpu.taken = cpu.rd = cpu.wr = 0;
+            if (!run) { c1 = cpu; for (int i=0; i<128; i++) res[i] = mem[lin(S_DS, c0.r[R_SI]+i-64)]; continue; }
+            if (memcmp(cpu.r, c1.r, sizeof cpu.r) || memcmp(cpu.sr, c1.sr, sizeof cpu.sr) || (cpu.fl^c1.fl)&mask) return 0;
+            for (int i=0; i<128; i++) if (mem[lin(S_DS, c0.r[R_SI]+i-64)]!=res[i]) return 0;
+        }
+    }
+    return 1;
+}
 
-/* PASS B: emit out.bin and free lines2 */
-static void asm_passB() {
-    out = fopen("out.bin","wb");
-    if(!out) die("cannot create output file");
+static void superopt() {
+    static char seq[SO_NSEQ][PEEP_LEN+1];
+    static SoEnt *ent[SO_NSEQ][2];
+    static PeepRule rule[1024];
+    static const char tk[] = "LS1";
+    int nseq = 0, nr = 0, nx = 0, sz[PEEP_LEN];
+    SoIns q[SO_SMALL];
+    uint32_t rng = 1;
+    soTab = (SoEnt*)calloc(SO_HASH, sizeof(SoEnt));
+    mem = (uint8_t*)calloc(MEMSZ, 1);
+    if (!soTab || !mem) die("out of memory");
+    for (int len=1; len<=PEEP_LEN; len++) {          // every sequence, shortest first
+        int d[PEEP_LEN] = {0};
+        for (;;) {
+            SoSt s; memset(&s, 0, sizeof s); s.al = SO_AL0;
+            for (int i=0; i<len; i++) {
+                SoIns x = { (uint8_t)(d[i]<2 ? d[i] : SO_ADD), (int8_t)(d[i]<2 ? 0 : d[i]-1) };
+                seq[nseq][i] = tk[d[i]];
+                soExec(&s, x);
+            }
+            seq[nseq][len] = 0;
+            ent[nseq][0] = soFind(&s, 0, 1); ent[nseq++][1] = soFind(&s, 1, 1);
+            int i = len-1;
+            while (i>=0 && ++d[i]==3) d[i--] = 0;
+            if (i<0) break;
+        }
+    }
+    SoSt s0; memset(&s0, 0, sizeof s0); s0.al = SO_AL0;
+    soSearch(q, 0, &s0, SO_BIG, 24, 0);
+    soSearch(q, 0, &s0, SO_SMALL, 4, 0);
+    for (int t=0; t<nseq; t++) {
+        char nt[PEEP_LEN+1];
+        int n = (int)strlen(seq[t]);
+        for (int dead=0; dead<2; dead++) {
+            SoEnt *e = ent[t][dead];
+            int m = peepNorm(strcpy(nt, seq[t]), NULL, n, rule, nr);
+            for (int i=0; i<m; i++) sz[i] = nt[i]=='L' || nt[i]=='S' ? 2 : 3;
+            if (e->cost>=peepPlan(nt, sz, m, dead, rule, nr, NULL)) continue;
+            if (nr==(int)(sizeof rule/sizeof rule[0])) die("superopt: more than %d rules", nr);
+            PeepRule *r = &rule[nr];
+            uint8_t a[PEEP_LEN*3]; int na = 0;
+            strcpy(r->from, seq[t]); r->dead = (uint8_t)dead; r->ni = (uint8_t)e->n;
+            r->n = (uint8_t)soBytes(e->seq, e->n, r->to);
+            for (int i=0; i<n; i++) {
+                if (seq[t][i]=='L') { a[na++] = 0x8A; a[na++] = 0x04; }
+                else if (seq[t][i]=='S') { a[na++] = 0x88; a[na++] = 0x04; }
+                else { a[na++] = 0x83; a[na++] = 0xC6; a[na++] = (uint8_t)(seq[t][i]-'0'); }
+            }
+            if (!soReplay(a, na, r->to, r->n, dead, &rng)) die("superopt: %s (%s) differs on the emulator", seq[t], dead ? "dead" : "exact");
+            nx += SO_RAND; nr++;
+        }
+    }
+    printf("/* BEGIN peepTab: generated by ./tri superopt, do not edit */\n"
+           "static const PeepRule peepTab[] = {\n");
+    for (int k=0; k<nr; k++) {
+        printf("    {\"%s\",%*s %d, %d, %2d, {", rule[k].from, PEEP_LEN-(int)strlen(rule[k].from), "",
+               rule[k].dead, rule[k].ni, rule[k].n);
+        for (int i=0; i<rule[k].n; i++) printf("%s0x%02X", i ? "," : "", rule[k].to[i]);
+        printf("}},\n");
+    }
+    printf("    {\"\", 0, 0, 0, {0}},\n};\n/* END peepTab */\n");
+    fprintf(stderr,"superopt: %d sequences, %ld candidates, %d rules, %d emulator runs\n", nseq, soCand, nr, 2*nx);
+    free(soTab); free(mem); mem = NULL;
+}
 
-    uint32_t pc=0;
-    for(int i=0;i<ln2;i++){
-        char tmp[LNSZ]; strcpy(tmp, lines2[i]);
-        char *save, *tok = strtok_r(tmp," \t,",&save);
-        if(!tok){ free(lines2[i]); continue; }
+static void usage(const char *me) {
+    fprintf(stderr,"Usage: %s <source.asm> [--prev old.bin] [--bank size] [--instrument=pmc:<evt>|tsc]\n"
+                   "       %s diff <old.bin> <new.bin> [--bank size]\n"
+                   "       %s perf-report <dump.bin>... [--map out.map] [--base off] [--json]\n"
+                   "       %s run <out.bin> [--entry addr] [--max n] [--dump mem.bin] [--base off]\n"
+                   "           [--handlers map] [--lat name=cycles] [--model vec=model] [--step] [--check]\n"
+                   "           [--until addr] [--save snap] [--batch jobs.txt [-j n]]\n"
+                   "       %s run --restore <snap> [run options]\n"
+                   "       %s tune <source.asm> [--grid|--hill] [-j n] [--metric cycles|instructions]\n"
+                   "           [--set name=value] [-o tuned.tasm] [run options]\n"
+                   "       %s superopt > rules\n", me, me, me, me, me, me, me);
+    exit(1);
+}
 
-        if(!strcmp(tok,"ORG")){
-            unsigned v = parseImm(strtok_r(NULL," \t,",&save), i);
-            pc=v; fseek(out,pc,SEEK_SET);
-            free(lines2[i]); continue;
+int main(int argc,char**argv){
+    static const char *img[MAXL];
+    const char *fn = NULL, *prev = NULL, *map = "out.map", *dump = NULL, *save = NULL, *batch = NULL;
+    const char *tuned = "tuned.tasm";
+    uint32_t v, base = 0;
+    int baseSet = 0;
+    int diff = argc>1 && !strcmp(argv[1],"diff"), rep = argc>1 && !strcmp(argv[1],"perf-report");
+    int run = argc>1 && !strcmp(argv[1],"run"), ni = 0, json = 0, restore = 0;
+    int tuneCmd = argc>1 && !strcmp(argv[1],"tune"), emu = run||tuneCmd, hill = 0;
+    int nthr = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if(emu) initModels();
+    for(int a=1+diff+rep+emu;a<argc;a++){
+        if(!strcmp(argv[a],"--prev") && a+1<argc) prev = argv[++a];
+        else if(!strcmp(argv[a],"--map") && a+1<argc) map = argv[++a];
+        else if(!strcmp(argv[a],"--json")) json = 1;
+        else if(!strcmp(argv[a],"--base") && a+1<argc){
+            if(!parseNum(argv[++a],&base)) die("--base: malformed offset");
+            baseSet = 1;
         }
-        if(!strcmp(tok,"DB")){
-            char *v;
-            while((v=strtok_r(NULL," \t,",&save))){
-                unsigned b=parseImm(v,i);
-                if(b>0xFF) dieAsm(i,"DB byte out of range: %u",b);
-                e8((uint8_t)b); pc++;
-            }
-            free(lines2[i]); continue;
+        else if(!strcmp(argv[a],"--instrument=tsc")) instrMode = INSTR_TSC;
+        else if(!strncmp(argv[a],"--instrument=pmc:",17)){
+            if(!parseNum(argv[a]+17,&v) || v>0xFF) die("--instrument=pmc:<event byte>");
+            instrMode = INSTR_PMC; instrEvt = (int)v;
         }
-        if(!strcmp(tok,"FILL")){
-            unsigned cnt=parseImm(strtok_r(NULL," \t,",&save), i);
-            unsigned val=parseImm(strtok_r(NULL," \t,",&save), i);
-            if(val>0xFF) dieAsm(i,"FILL byte out of range: %u",val);
-            for(unsigned j=0;j<cnt;j++){ e8((uint8_t)val); pc++; }
-            free(lines2[i]); continue;
+        else if(!strcmp(argv[a],"--bank") && a+1<argc){
+            if(!parseNum(argv[++a],&v) || v<16 || v>0x8000 || (v&(v-1))) die("--bank: power of two 16..0x8000");
+            bankSize = v;
         }
-        if(!strcmp(tok,"INT")){
-            unsigned imm=parseImm(strtok_r(NULL," \t,",&save), i);
-            if(imm>0xFF) dieAsm(i,"INT imm8 out of range: %u",imm);
-            e8(0xCD); e8((uint8_t)imm); pc+=2;
-            free(lines2[i]); continue;
+        else if(emu && !strcmp(argv[a],"--entry") && a+1<argc){
+            if(!parseNum(argv[++a],&runEntry) || runEntry>0xFFFFF) die("--entry: address below 1MB");
         }
-        if(!strcmp(tok,"JMP")||!strcmp(tok,"CALL")){
-            e8(tok[0]=='J'?0xE9:0xE8);
-            uint32_t dest=find_lbl(strtok_r(NULL," \t,",&save), i);
-            int32_t rel=(int32_t)dest-(int32_t)(pc+5);
-            e32((uint32_t)rel); pc+=5;
-            free(lines2[i]); continue;
+        else if(emu && !strcmp(argv[a],"--max") && a+1<argc) runMax = strtoull(argv[++a],NULL,0);
+        else if(run && !strcmp(argv[a],"--dump") && a+1<argc) dump = argv[++a];
+        else if(emu && !strcmp(argv[a],"--step")) runStep = 1;
+        else if(run && !strcmp(argv[a],"--check")) runCheck = 1;
+        else if(run && !strcmp(argv[a],"--save") && a+1<argc) save = argv[++a];
+        else if(run && !strcmp(argv[a],"--restore") && a+1<argc && !ni){ img[ni++] = argv[++a]; restore = 1; }
+        else if(run && !strcmp(argv[a],"--batch") && a+1<argc) batch = argv[++a];
+        else if(emu && !strcmp(argv[a],"-j") && a+1<argc) nthr = atoi(argv[++a]);
+        else if(!diff && !rep && !run && !strcmp(argv[a],"--set") && a+1<argc) setSym(argv[++a]);
+        else if(tuneCmd && !strcmp(argv[a],"--grid")) hill = 0;
+        else if(tuneCmd && !strcmp(argv[a],"--hill")) hill = 1;
+        else if(tuneCmd && !strcmp(argv[a],"-o") && a+1<argc) tuned = argv[++a];
+        else if(tuneCmd && !strcmp(argv[a],"--metric") && a+1<argc){
+            a++;
+            if(!strcmp(argv[a],"instructions")) tuneIns = 1;
+            else if(strcmp(argv[a],"cycles")) die("--metric cycles|instructions");
         }
-        if(!strcmp(tok,"LJMP")){
-            e8(0xEA);
-            char *p = strtok_r(NULL," \t,",&save);
-            char *sg = strchr(p,':'); *sg++=0;
-            unsigned off=parseImm(p,i), s=parseImm(sg,i);
-            e32(off); e16((uint16_t)s); pc+=6;
-            free(lines2[i]); continue;
+        else if(emu && !strcmp(argv[a],"--until") && a+1<argc){
+            if(!parseNum(argv[++a],&runUntil) || runUntil>0xFFFFF) die("--until: address below 1MB");
         }
-        if(tok[strlen(tok)-1]==':'){
-            free(lines2[i]); continue;
+        else if(emu && !strcmp(argv[a],"--handlers") && a+1<argc) loadHandlers(-1, argv[++a]);
+        else if(emu && !strcmp(argv[a],"--model") && a+1<argc) setModel(argv[++a]);
+        else if(emu && !strcmp(argv[a],"--lat") && a+1<argc){
+            char *eq = strchr(argv[++a],'=');
+            int k = eq ? (*eq=0, findIntrName(argv[a])) : -1;
+            if(k<0 || !parseNum(eq+1,&v)) die("--lat <intrinsic>=<cycles>");
+            latSet[k] = v;
         }
-        dieAsm(i,"unknown directive '%s'", tok);
+        else if(argv[a][0]=='-') usage(argv[0]);
+        else if((diff && ni<2) || (rep && ni<MAXL) || (run && ni<1)) img[ni++] = argv[a];
+        else if(!diff && !rep && !run && !fn) fn = argv[a];
+        else usage(argv[0]);
     }
-    fclose(out);
-}
-
-int main(int argc,char**argv){
-    if(argc!=2){
-        fprintf(stderr,"Usage: %s <source.asm>\n",argv[0]);
-        return 1;
+    if(rep){
+        if(!ni) usage(argv[0]);
+        perfReport(img, ni, map, baseSet ? (long)base : -1, json);
+        return 0;
     }
-    read_src(argv[1]);
-    pass1();
-    asm_passA();
-    asm_passB();
+    if(run){
+        if(!ni) usage(argv[0]);
+        if(base) timerBase = base;
+        if(batch) runBatch(img[0], restore, batch, nthr);
+        else runImage(img[0], dump, save, restore);
+        return 0;
+    }
+    if(diff){
+        if(ni!=2) usage(argv[0]);
+        diffImages(img[0], img[1], "patch.tasm");
+        return 0;
+    }
+    if(argc==2 && !strcmp(argv[1],"superopt")){
+        superopt();
+        return 0;
+    }
+    if(!fn) usage(argv[0]);
+    read_src(fn);
+    if(tuneCmd){
+        tune(fn, tuned, hill, nthr);
+        return 0;
+    }
+    build();
+    if(prev) diffImages(prev, outBin, "patch.tasm");
     return 0;
 }